@@ -0,0 +1,438 @@
+/*
+ * Synthetic desktop load for sizing the compositor.
+ *
+ * Opens a set of client windows and keeps them busy at fixed rates:
+ * damage (scrolling, random rectangles or full-window "video"), stacking
+ * and position churn, _NET_WM_WINDOW_OPACITY changes, bounding shape
+ * changes and short-lived override-redirect popups.  Each of these ends
+ * up in one of the compositor's handlers (add_win, damage_win,
+ * configure_win, shape_win, the opacity PropertyNotify path), so a run
+ * paired with the compositor's statistics shows where it stops scaling.
+ *
+ * Actions are scheduled on a simulated clock of TICK steps that follows
+ * the wall clock, catching up in bursts when the client falls behind, so
+ * the same seed and options replay the same sequence of requests.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <getopt.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/shape.h>
+#include <vector>
+#include <list>
+
+enum Pattern {
+    PatternScroll,
+    PatternRects,
+    PatternVideo,
+};
+
+struct client {
+    Window id;
+    GC gc;
+    int width, height;
+    Bool argb;
+    Bool shaped;
+    unsigned long pixel;
+};
+
+struct popup {
+    Window id;
+    double expires;
+};
+
+static Display *dpy;
+static int scr;
+static Window root;
+static int root_width, root_height;
+static Atom opacityAtom;
+static Visual *argbVisual;
+static Colormap argbColormap;
+
+static std::vector<client> clients;
+static std::list<popup> popups;
+
+/* simulated seconds per scheduling step */
+#define TICK 0.001
+
+/* options */
+static int numWindows = 20;
+static int minSize = 100, maxSize = 600;
+static double damageRate = 60;
+static Pattern pattern = PatternRects;
+static double churnRate = 2;
+static double argbFraction = 0.2;
+static double opacityRate = 2;
+static double shapeRate = 1;
+static double popupRate = 1;
+static double duration = 30;
+static unsigned int seed = 1;
+
+/* totals printed at the end */
+static struct {
+    unsigned long damages;
+    unsigned long churns;
+    unsigned long opacities;
+    unsigned long shapes;
+    unsigned long popups;
+} counts;
+
+static int
+random_int(int lo, int hi) {
+    if (hi <= lo)
+        return lo;
+    return lo + rand() % (hi - lo + 1);
+}
+
+static double
+now() {
+    timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long
+random_pixel(Bool argb) {
+    unsigned long pixel = rand() & 0xffffff;
+
+    /* premultiplied, half transparent */
+    if (argb)
+        return 0x80000000 | ((pixel >> 1) & 0x7f7f7f);
+    return pixel;
+}
+
+static void
+find_argb_visual() {
+    XVisualInfo vinfo;
+
+    if (!XMatchVisualInfo(dpy, scr, 32, TrueColor, &vinfo))
+        return;
+    argbVisual = vinfo.visual;
+    argbColormap = XCreateColormap(dpy, root, argbVisual, AllocNone);
+}
+
+static Window
+create_window(int x, int y, int width, int height, Bool argb, Bool overrideRedirect) {
+    XSetWindowAttributes attr{};
+    unsigned long mask = CWBackPixel | CWBorderPixel | CWOverrideRedirect;
+
+    attr.background_pixel = random_pixel(argb);
+    attr.border_pixel = 0;
+    attr.override_redirect = overrideRedirect;
+    if (argb) {
+        attr.colormap = argbColormap;
+        mask |= CWColormap;
+        return XCreateWindow(dpy, root, x, y, width, height, 0, 32, InputOutput,
+                             argbVisual, mask, &attr);
+    }
+    return XCreateWindow(dpy, root, x, y, width, height, 0, CopyFromParent, InputOutput,
+                         CopyFromParent, mask, &attr);
+}
+
+static void
+add_client() {
+    client c{};
+
+    c.width = random_int(minSize, maxSize);
+    c.height = random_int(minSize, maxSize);
+    c.argb = argbVisual && rand() < argbFraction * RAND_MAX;
+    c.id = create_window(random_int(0, root_width - c.width / 2),
+                         random_int(0, root_height - c.height / 2),
+                         c.width, c.height, c.argb, False);
+    c.gc = XCreateGC(dpy, c.id, 0, nullptr);
+    c.pixel = random_pixel(c.argb);
+    XMapWindow(dpy, c.id);
+    clients.push_back(c);
+}
+
+static void
+damage_client(client &c) {
+    int x, y, w, h;
+
+    switch (pattern) {
+        case PatternScroll:
+            /* move the contents up and paint the uncovered strip */
+            XCopyArea(dpy, c.id, c.id, c.gc, 0, 16, c.width, c.height - 16, 0, 0);
+            c.pixel = random_pixel(c.argb);
+            XSetForeground(dpy, c.gc, c.pixel);
+            XFillRectangle(dpy, c.id, c.gc, 0, c.height - 16, c.width, 16);
+            break;
+        case PatternRects:
+            w = random_int(1, c.width / 4 + 1);
+            h = random_int(1, c.height / 4 + 1);
+            x = random_int(0, c.width - w);
+            y = random_int(0, c.height - h);
+            XSetForeground(dpy, c.gc, random_pixel(c.argb));
+            XFillRectangle(dpy, c.id, c.gc, x, y, w, h);
+            break;
+        case PatternVideo:
+            XSetForeground(dpy, c.gc, random_pixel(c.argb));
+            XFillRectangle(dpy, c.id, c.gc, 0, 0, c.width, c.height);
+            break;
+    }
+    counts.damages++;
+}
+
+static void
+churn_client(client &c) {
+    if (rand() & 1) {
+        XRaiseWindow(dpy, c.id);
+    } else {
+        int w = random_int(minSize, maxSize);
+        int h = random_int(minSize, maxSize);
+        XMoveResizeWindow(dpy, c.id,
+                          random_int(0, root_width - w / 2),
+                          random_int(0, root_height - h / 2), w, h);
+        c.width = w;
+        c.height = h;
+    }
+    counts.churns++;
+}
+
+static void
+change_opacity(client &c) {
+    if (rand() % 4 == 0) {
+        XDeleteProperty(dpy, c.id, opacityAtom);
+    } else {
+        unsigned long opacity = ((unsigned long) rand() << 16 ^ rand()) & 0xffffffff;
+        XChangeProperty(dpy, c.id, opacityAtom, XA_CARDINAL, 32, PropModeReplace,
+                        (unsigned char *) &opacity, 1);
+    }
+    counts.opacities++;
+}
+
+static void
+change_shape(client &c) {
+    if (c.shaped) {
+        XShapeCombineMask(dpy, c.id, ShapeBounding, 0, 0, None, ShapeSet);
+        c.shaped = False;
+    } else {
+        /* a plus sign, a few rectangles like most shaped clients */
+        int bw = c.width / 3, bh = c.height / 3;
+        XRectangle rects[] = {
+                {static_cast<short>(bw), 0,
+                 static_cast<unsigned short>(bw), static_cast<unsigned short>(c.height)},
+                {0, static_cast<short>(bh),
+                 static_cast<unsigned short>(c.width), static_cast<unsigned short>(bh)},
+        };
+        XShapeCombineRectangles(dpy, c.id, ShapeBounding, 0, 0, rects, 2, ShapeSet, Unsorted);
+        c.shaped = True;
+    }
+    counts.shapes++;
+}
+
+static void
+open_popup(double t) {
+    int w = random_int(minSize / 2, maxSize / 2);
+    int h = random_int(minSize / 4, maxSize / 4);
+    popup p;
+
+    p.id = create_window(random_int(0, root_width - w), random_int(0, root_height - h),
+                         w, h, False, True);
+    p.expires = t + 0.05 + (rand() % 250) / 1000.0;
+    XMapWindow(dpy, p.id);
+    popups.push_back(p);
+    counts.popups++;
+}
+
+static void
+close_popups(double t) {
+    for (auto p = popups.begin(); p != popups.end();) {
+        if (p->expires <= t) {
+            XDestroyWindow(dpy, p->id);
+            p = popups.erase(p);
+        } else {
+            p++;
+        }
+    }
+}
+
+/* Turn a rate into whole actions: owed carries the fraction over so
+   low rates still fire at the right average.  Called with a fixed dt,
+   the result does not depend on timing. */
+static int
+due(double rate, double dt, double *owed) {
+    *owed += rate * dt;
+    int n = (int) *owed;
+    *owed -= n;
+    return n;
+}
+
+static void
+usage(const char *program) {
+    fprintf(stderr, "usage: %s [options]\n%s\n", program,
+            "Options:\n"
+            "   -d display\n"
+            "      Specifies which display should be loaded.\n"
+            "   -n windows\n"
+            "      Number of client windows. (default 20)\n"
+            "   -s min:max\n"
+            "      Range of window widths and heights. (default 100:600)\n"
+            "   -r rate\n"
+            "      Damage updates per second, spread over all windows. (default 60)\n"
+            "   -p scroll|rects|video\n"
+            "      Damage pattern. (default rects)\n"
+            "   -c rate\n"
+            "      Raises and move-resizes per second. (default 2)\n"
+            "   -a fraction\n"
+            "      Fraction of windows with an ARGB visual. (default 0.2)\n"
+            "   -o rate\n"
+            "      _NET_WM_WINDOW_OPACITY changes per second. (default 2)\n"
+            "   -S rate\n"
+            "      Bounding shape changes per second. (default 1)\n"
+            "   -P rate\n"
+            "      Override-redirect popups per second. (default 1)\n"
+            "   -t seconds\n"
+            "      Length of the run. (default 30)\n"
+            "   -z seed\n"
+            "      Random seed; the same seed replays the same load. (default 1)\n"
+    );
+    exit(1);
+}
+
+int
+main(int argc, char **argv) {
+    char *display = nullptr;
+    int o;
+
+    while ((o = getopt(argc, argv, "d:n:s:r:p:c:a:o:S:P:t:z:")) != -1) {
+        switch (o) {
+            case 'd':
+                display = optarg;
+                break;
+            case 'n':
+                numWindows = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%d:%d", &minSize, &maxSize) != 2 || minSize < 4 || maxSize < minSize)
+                    usage(argv[0]);
+                break;
+            case 'r':
+                damageRate = atof(optarg);
+                break;
+            case 'p':
+                if (!strcmp(optarg, "scroll"))
+                    pattern = PatternScroll;
+                else if (!strcmp(optarg, "rects"))
+                    pattern = PatternRects;
+                else if (!strcmp(optarg, "video"))
+                    pattern = PatternVideo;
+                else
+                    usage(argv[0]);
+                break;
+            case 'c':
+                churnRate = atof(optarg);
+                break;
+            case 'a':
+                argbFraction = atof(optarg);
+                break;
+            case 'o':
+                opacityRate = atof(optarg);
+                break;
+            case 'S':
+                shapeRate = atof(optarg);
+                break;
+            case 'P':
+                popupRate = atof(optarg);
+                break;
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'z':
+                seed = strtoul(optarg, nullptr, 0);
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (numWindows < 1)
+        usage(argv[0]);
+
+    dpy = XOpenDisplay(display);
+    if (!dpy) {
+        fprintf(stderr, "Can't open display\n");
+        exit(1);
+    }
+    scr = DefaultScreen (dpy);
+    root = RootWindow (dpy, scr);
+    root_width = DisplayWidth (dpy, scr);
+    root_height = DisplayHeight (dpy, scr);
+    opacityAtom = XInternAtom(dpy, "_NET_WM_WINDOW_OPACITY", False);
+    srand(seed);
+    find_argb_visual();
+    if (!argbVisual && argbFraction > 0)
+        fprintf(stderr, "No 32-bit TrueColor visual, all windows are opaque\n");
+
+    clients.reserve(numWindows);
+    for (int i = 0; i < numWindows; i++)
+        add_client();
+    XSync(dpy, False);
+
+    double damageOwed = 0, churnOwed = 0, opacityOwed = 0, shapeOwed = 0, popupOwed = 0;
+    long ticks = (long) (duration / TICK), tick = 0;
+    double start = now();
+    pollfd ufd{};
+    ufd.fd = ConnectionNumber (dpy);
+    ufd.events = POLLIN;
+    while (tick < ticks) {
+        long target = (long) ((now() - start) / TICK);
+        if (target > ticks)
+            target = ticks;
+
+        for (; tick < target; tick++) {
+            double t = tick * TICK;
+
+            for (int n = due(damageRate, TICK, &damageOwed); n > 0; n--)
+                damage_client(clients[rand() % clients.size()]);
+            for (int n = due(churnRate, TICK, &churnOwed); n > 0; n--)
+                churn_client(clients[rand() % clients.size()]);
+            for (int n = due(opacityRate, TICK, &opacityOwed); n > 0; n--)
+                change_opacity(clients[rand() % clients.size()]);
+            for (int n = due(shapeRate, TICK, &shapeOwed); n > 0; n--)
+                change_shape(clients[rand() % clients.size()]);
+            for (int n = due(popupRate, TICK, &popupOwed); n > 0; n--)
+                open_popup(t);
+            close_popups(t);
+        }
+
+        /* nothing is selected, but errors and the odd event still arrive */
+        XFlush(dpy);
+        while (XPending(dpy)) {
+            XEvent ev;
+            XNextEvent(dpy, &ev);
+        }
+        /* a millisecond tick is fine enough for rates in the thousands */
+        if (poll(&ufd, 1, 1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+    }
+
+    double elapsed = now() - start;
+    for (auto &p : popups)
+        XDestroyWindow(dpy, p.id);
+    for (auto &c : clients) {
+        XFreeGC(dpy, c.gc);
+        XDestroyWindow(dpy, c.id);
+    }
+    XCloseDisplay(dpy);
+
+    printf("seconds %.2f\n", elapsed);
+    printf("windows %d\n", numWindows);
+    printf("damages %lu (%.1f/s)\n", counts.damages, counts.damages / elapsed);
+    printf("churns %lu\n", counts.churns);
+    printf("opacity_changes %lu\n", counts.opacities);
+    printf("shape_changes %lu\n", counts.shapes);
+    printf("popups %lu\n", counts.popups);
+    return 0;
+}
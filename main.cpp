@@ -29,10 +29,23 @@
 #include "config.h"
 #endif
 
+#include <cassert>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
 #include <sys/poll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <getopt.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -41,8 +54,21 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <vector>
 #include <list>
+#include <new>
+#include <string>
+#include <atomic>
+#include <thread>
+/* for XESetBeforeFlush; it brings min and max macros along */
+#include <X11/Xlibint.h>
+#undef min
+#undef max
 
 #if COMPOSITE_MAJOR > 0 || COMPOSITE_MINOR >= 2
 #define HAS_NAME_WINDOW_PIXMAP 1
@@ -54,7 +80,12 @@ struct win {
     Window id;
 #if HAS_NAME_WINDOW_PIXMAP
     Pixmap pixmap;
+    long pixmapBytes;    /* charged against pixmapBudget */
+    /* pixmap kept from before the last unmap, shown until the window is
+       first damaged again */
+    Bool stale;
 #endif
+    unsigned long lastUsed;    /* frame the window was last painted in */
     XWindowAttributes a;
 #if CAN_DO_USABLE
     Bool		usable;		    /* mapped and all damaged at one point */
@@ -65,41 +96,627 @@ struct win {
     Damage damage;
     Picture picture;
     Picture alphaPict;
+    Picture shadowPict;
     XserverRegion borderSize;
     XserverRegion extents;
+    XRectangle extentsRect;
     unsigned int opacity;
     Atom windowType;
     unsigned long damage_sequence;    /* sequence when damage was created */
+    /* first damage since the window was last painted, for latencyHist */
+    Bool damageWaiting;
+    timespec damagedAt;
+    /* repair_win calls since the last heatmap sample, and the count of
+       the sample before, drawn as a bar over the window */
+    unsigned repaints;
+    unsigned repaintRate;
+    /* in hybrid mode, redirected manually on its own */
+    Bool redirected;
+    /* adaptive quality, see update_quality */
+    int paintMode;    /* the mode of the frame being painted */
+    timespec movedAt;    /* last plain move */
+    Bool blendSkipped;    /* ARGB painted opaque while moving */
+    Bool background;    /* below the topmost normal window */
+    XRectangle deferred;    /* damage held back while background */
+    /* retained backdrop, see update_backdrop */
+    unsigned long damageFrame;    /* frames painted when last damaged */
+    int damageStreak;    /* consecutive frames damaged */
+    Bool aboveLayer;    /* the backdrop's layer window or above it */
     Bool shaped;
     XRectangle shape_bounds;
+    /* bounding shape relative to the window origin, valid once shapeKnown;
+       only refreshed by ShapeNotify */
+    Bool shapeKnown;
+    std::vector<XRectangle> shapeRects;
+
+    /* client-side shadow, shared with every window of the same size */
+    Picture shadow;
+    int shadow_dx;
+    int shadow_dy;
+    int shadow_width;
+    int shadow_height;
+    int shadow_level;
+
+    /* fade in once the opacity of the freshly mapped window is known */
+    Bool fadeIn;
+
+    /* downscaled copy for pagers, see update_thumbnails */
+    Pixmap thumbPixmap;
+    Picture thumbPicture;
+    Picture thumbSource;    /* the window contents, scaled by a transform */
+    int thumbWidth, thumbHeight;
+    XRectangle thumbDirty;    /* in window coordinates, border included */
 
     /* for drawing translucent windows */
     XserverRegion borderClip;
 };
 using win_it = std::_List_iterator<win>;
 
-static std::list<win> win_list;
-static int scr;
-static Window root;
-static Picture rootPicture;
-static Picture rootBuffer;
-static Picture blackPicture;
-static Picture rootTile;
-static XserverRegion allDamage;
-static Bool clipChanged;
+static thread_local std::list<win> win_list;
+static thread_local xcb_connection_t *xconn;
+static thread_local int scr;
+static thread_local Window root;
+static int screenCount = 1;
+static thread_local Picture rootPicture;
+static thread_local Picture rootBuffer;
+static thread_local Picture blackPicture;
+static thread_local Picture transBlackPicture;
+static thread_local Picture rootTile;
+/* Damage is accumulated on the client in a grid of DAMAGE_TILE squares
+   and turned into at most MAX_DAMAGE_RECTS rectangles per frame, trading
+   a little overdraw for short clip lists. */
+#define DAMAGE_TILE 64
+#define MAX_DAMAGE_RECTS 16
+
+static thread_local std::vector<unsigned char> damageTiles;
+static thread_local int tilesX, tilesY;
+/* the rectangles of the frame being painted, as sent to the server */
+static thread_local std::vector<XRectangle> frameRects;
+static thread_local Bool damagePending;
+/* The output is hidden while DPMS has the monitor off or a screensaver
+   is up; see output_hidden. */
+static thread_local Bool hasDpms;
+static thread_local Bool dpmsOff;
+static thread_local timespec dpmsChecked;
+static thread_local Bool saverOn;
+static thread_local Bool saverBlanked;    /* by the video hardware, no window */
+static thread_local Window saverWindow;
+static thread_local Bool saverDamaged;
+/* Retained backdrop: the root and the windows below the layer window,
+   composited once and reused while only the layer and the windows above
+   it are damaged.  backdropTiles marks the parts gone stale. */
+static thread_local Picture backdrop;
+static thread_local Window backdropLayer;
+static thread_local std::vector<unsigned char> backdropTiles;
+/* set while damage from the layer or above is being added */
+static thread_local Bool layerDamage;
+/* Adaptive quality: while the average frame takes longer than
+   frameBudget, paint cheaper; see update_quality. */
+static double frameBudget;
+static thread_local Bool degraded;
+static thread_local double frameAverage;
+static thread_local timespec degradedAt;
+/* per tile heat for the repaint heatmap, toggled by SIGUSR2 */
+static thread_local Bool heatmap;
+static thread_local std::vector<unsigned char> heat;
 #if HAS_NAME_WINDOW_PIXMAP
-static Bool hasNamePixmap;
+static thread_local Bool hasNamePixmap;
+/* Window pixmaps are kept across unmaps while their total stays under
+   this many bytes; 0 frees them on unmap as before. */
+static long pixmapBudget = 128L << 20;
+static thread_local long pixmapTotal;
 #endif
-static int root_height, root_width;
-static int xfixes_event, xfixes_error;
-static int damage_event, damage_error;
-static int composite_event, composite_error;
-static int render_event, render_error;
-static int xshape_event, xshape_error;
+static thread_local int root_height, root_width;
+static thread_local int xfixes_event, xfixes_error;
+static thread_local int damage_event, damage_error;
+static thread_local int composite_event, composite_error;
+static thread_local int render_event, render_error;
+static thread_local int xshape_event, xshape_error;
+/* -1 without MIT-SCREEN-SAVER */
+static thread_local int saver_event = -1;
 static Bool synchronize;
-static int composite_opcode;
+static thread_local int composite_opcode;
+
+/* Sequence numbers whose errors are expected, oldest first.  A ring
+   that only grows when it fills up, so steady state allocates nothing. */
+static thread_local std::vector<unsigned long> ignores(256);
+static thread_local size_t ignoreHead, ignoreCount;
+
+/* damage covering this much of the screen is repainted without per-window clipping */
+static double fullRepaintFraction = 0.75;
+
+/* counters reported on SIGUSR1 */
+static thread_local struct {
+    unsigned long frames;
+    unsigned long fullFrames;    /* painted through the full-screen path */
+    unsigned long long damagePixels;
+    unsigned long long damageRects;
+    unsigned long long frameRequests;    /* issued while painting */
+    unsigned long clipsSet;
+    unsigned long clipsSkipped;
+    unsigned long long modeWins[3];    /* windows painted, by WINDOW_* mode */
+    unsigned long pixmapsReused;    /* maps shown from a kept pixmap */
+    unsigned long pixmapsEvicted;
+    unsigned long backdropFrames;    /* painted over the retained backdrop */
+    unsigned long framesWithheld;    /* event batches not painted, output hidden */
+    unsigned long degrades;    /* quality lowered under overload */
+    unsigned long restores;
+    double degradedSeconds;    /* up to the last restore */
+} stats;
+
+/* Request accounting: every buffer Xlib flushes is walked request by
+   request and tallied by opcode.  Requests sent straight through xcb are
+   not seen here, they only happen outside of painting.
+ */
+static thread_local int render_opcode, xfixes_opcode, damage_opcode, xshape_opcode;
+static thread_local unsigned long coreRequests[128];
+static thread_local unsigned long extRequests[128][256];
+static thread_local long requestSkip;    /* rest of a request whose data went out separately */
+
+static void
+count_requests(Display *dpy, XExtCodes *codes, const char *data, long len) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    while (len > 0) {
+        if (requestSkip) {
+            long n = requestSkip < len ? requestSkip : len;
+            p += n;
+            len -= n;
+            requestSkip -= n;
+            continue;
+        }
+        /* Xlib only splits a request after its header */
+        if (len < 4)
+            return;
+        uint16_t words;
+        memcpy(&words, p + 2, sizeof(words));
+        unsigned long length = words;
+        if (!length && len >= 8) {
+            uint32_t big;
+            memcpy(&big, p + 4, sizeof(big));
+            length = big;
+        }
+        if (!length)
+            return;
+        if (p[0] < 128)
+            coreRequests[p[0]]++;
+        else
+            extRequests[p[0] - 128][p[1]]++;
+        requestSkip = (long) length * 4;
+    }
+}
+
+static void
+print_requests(unsigned long frames) {
+    /* names only; the opcodes are this thread's, in the same order */
+    static const struct {
+        const char *ext;
+        const char *names[32];
+    } known[] = {
+            {"RENDER",    {nullptr, nullptr, nullptr, nullptr, "CreatePicture", nullptr,
+                           nullptr, "FreePicture", "Composite", nullptr, nullptr, nullptr,
+                           nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                           nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                           "FillRectangles"}},
+            {"XFIXES",    {nullptr, nullptr, nullptr, nullptr, nullptr, "CreateRegion",
+                           nullptr, "CreateRegionFromWindow", nullptr, nullptr, "DestroyRegion",
+                           nullptr, "CopyRegion", "UnionRegion", "IntersectRegion",
+                           "SubtractRegion", nullptr, "TranslateRegion", nullptr,
+                           "FetchRegion", nullptr, nullptr, "SetPictureClipRegion"}},
+            {"DAMAGE",    {nullptr, "Create", "Destroy", "Subtract", "Add"}},
+            {"Composite", {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                           "NameWindowPixmap"}},
+            {"SHAPE",     {}},
+    };
+    const int knownMajors[] = {render_opcode, xfixes_opcode, damage_opcode,
+                               composite_opcode, xshape_opcode};
+
+    static const struct {
+        int major;
+        const char *name;
+    } core[] = {
+            {X_ChangeWindowAttributes, "ChangeWindowAttributes"},
+            {X_GetInputFocus,          "GetInputFocus"},
+            {X_CreatePixmap,           "CreatePixmap"},
+            {X_FreePixmap,             "FreePixmap"},
+            {X_CreateGC,               "CreateGC"},
+            {X_FreeGC,                 "FreeGC"},
+            {X_ClearArea,              "ClearArea"},
+            {X_PutImage,               "PutImage"},
+    };
+
+    for (int major = 0; major < 128; major++) {
+        if (!coreRequests[major])
+            continue;
+        const char *name = nullptr;
+        for (auto &c : core) {
+            if (c.major == major)
+                name = c.name;
+        }
+        if (name)
+            fprintf(stderr, "  core %s: %.1f\n", name, (double) coreRequests[major] / frames);
+        else
+            fprintf(stderr, "  core %d: %.1f\n", major, (double) coreRequests[major] / frames);
+    }
+    for (int major = 128; major < 256; major++) {
+        const char *ext = nullptr;
+        const char *const *names = nullptr;
+        for (size_t k = 0; k < sizeof(known) / sizeof(known[0]); k++) {
+            if (knownMajors[k] == major) {
+                ext = known[k].ext;
+                names = known[k].names;
+            }
+        }
+        for (int minor = 0; minor < 256; minor++) {
+            unsigned long count = extRequests[major - 128][minor];
+            if (!count)
+                continue;
+            if (ext && minor < 32 && names[minor])
+                fprintf(stderr, "  %s %s: %.1f\n", ext, names[minor], (double) count / frames);
+            else if (ext)
+                fprintf(stderr, "  %s %d: %.1f\n", ext, minor, (double) count / frames);
+            else
+                fprintf(stderr, "  %d.%d: %.1f\n", major, minor, (double) count / frames);
+        }
+    }
+}
+
+/* The clip last set on each picture we paint into.  A region id only
+   stands for its contents until it is changed or destroyed, so those
+   paths call forget_clip_region.
+ */
+#define CLIP_UNKNOWN ((XserverRegion) ~0UL)
+
+static thread_local struct {
+    Picture picture;
+    XserverRegion region;
+} clipCache[4];
+
+static void
+set_clip(Display *dpy, Picture picture, XserverRegion region) {
+    int slot = -1;
+
+    for (int i = 0; i < 4; i++) {
+        if (clipCache[i].picture == picture) {
+            if (clipCache[i].region == region) {
+                stats.clipsSkipped++;
+                return;
+            }
+            slot = i;
+            break;
+        }
+        if (slot < 0 && clipCache[i].picture == None)
+            slot = i;
+    }
+    XFixesSetPictureClipRegion(dpy, picture, 0, 0, region);
+    stats.clipsSet++;
+    if (slot >= 0) {
+        clipCache[slot].picture = picture;
+        clipCache[slot].region = region;
+    }
+}
+
+static void
+forget_clip_region(XserverRegion region) {
+    for (auto &c : clipCache) {
+        if (c.region == region)
+            c.region = CLIP_UNKNOWN;
+    }
+}
+
+static void
+forget_clip_picture(Picture picture) {
+    for (auto &c : clipCache) {
+        if (c.picture == picture) {
+            c.picture = None;
+            c.region = None;
+        }
+    }
+}
+
+static void
+destroy_region(Display *dpy, XserverRegion region) {
+    forget_clip_region(region);
+    XFixesDestroyRegion(dpy, region);
+}
+
+/* Histograms for the metrics socket.  Bounds are ascending inclusive
+   upper limits; the last count is everything above them. */
+#define HIST_BUCKETS 12
+
+struct histogram {
+    const char *name;
+    const char *help;
+    double bounds[HIST_BUCKETS];
+    unsigned long counts[HIST_BUCKETS + 1];
+    double sum;
+    unsigned long count;
+    const char *label;    /* type="..." when several share the name */
+};
+
+static thread_local histogram frameTimeHist = {"compander_frame_seconds",
+                                  "Time from building the damage region to the end of the XSync",
+                                  {0.0005, 0.001, 0.002, 0.004, 0.008, 0.012,
+                                   0.016, 0.025, 0.033, 0.05, 0.1, 0.25}};
+static thread_local histogram batchHist = {"compander_event_batch_size",
+                              "X events handled between two frames",
+                              {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096}};
+static thread_local histogram damageHist = {"compander_damage_pixels",
+                               "Pixels repainted per frame",
+                               {1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 17, 1 << 18,
+                                1 << 19, 1 << 20, 1 << 21, 1 << 22, 1 << 23, 1 << 24}};
+static thread_local histogram requestHist = {"compander_frame_requests",
+                                "X requests issued per frame",
+                                {4, 8, 16, 32, 48, 64, 96, 128, 192, 256, 512, 1024}};
+
+/* From the first damage a window reports after it was last painted to
+   the XSync that completes the frame showing it, by window type */
+#define LATENCY_NORMAL  0
+#define LATENCY_DIALOG  1
+#define LATENCY_MENU    2
+#define LATENCY_DOCK    3
+#define LATENCY_OTHER   4
+#define LATENCY_CLASSES 5
+#define LATENCY_HIST(type) {"compander_damage_latency_seconds", \
+                            "Time from a window's damage to the end of the frame presenting it", \
+                            {0.001, 0.002, 0.004, 0.008, 0.012, 0.016, \
+                             0.025, 0.033, 0.05, 0.1, 0.25, 0.5}, {}, 0, 0, type}
+
+static thread_local histogram latencyHist[LATENCY_CLASSES] = {
+        LATENCY_HIST("normal"),
+        LATENCY_HIST("dialog"),
+        LATENCY_HIST("menu"),
+        LATENCY_HIST("dock"),
+        LATENCY_HIST("other"),
+};
+
+static void
+hist_add(histogram *h, double v) {
+    int i = 0;
+
+    while (i < HIST_BUCKETS && v > h->bounds[i])
+        i++;
+    h->counts[i]++;
+    h->sum += v;
+    h->count++;
+}
+
+static double
+elapsed(const timespec &start) {
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* upper bound of the bucket holding the q-th quantile, or -1 above them all */
+static double
+hist_quantile(const histogram *h, double q) {
+    unsigned long want = (unsigned long) ceil(h->count * q);
+    unsigned long cumulative = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        cumulative += h->counts[i];
+        if (cumulative >= want)
+            return h->bounds[i];
+    }
+    return -1;
+}
+
+/* a quantile in milliseconds as "<= bound", or "> top bound" when it
+   lies past the last bucket */
+static const char *
+quantile_ms(char *buf, size_t size, const histogram *h, double q) {
+    double bound = hist_quantile(h, q);
+
+    if (bound < 0)
+        snprintf(buf, size, "> %g", h->bounds[HIST_BUCKETS - 1] * 1000);
+    else
+        snprintf(buf, size, "<= %g", bound * 1000);
+    return buf;
+}
 
-static std::list<unsigned long> ignores;
+static void
+print_stats() {
+    rusage ru{};
+
+    /* screens report from their own threads, keep each report in one piece */
+    flockfile(stderr);
+    if (screenCount > 1)
+        fprintf(stderr, "screen %d\n", scr);
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "cpu_seconds %.3f\n",
+            ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+    fprintf(stderr, "max_rss_kb %ld\n", ru.ru_maxrss);
+    fprintf(stderr, "frames %lu\n", stats.frames);
+    fprintf(stderr, "frames_full %lu (threshold %.2f)\n", stats.fullFrames, fullRepaintFraction);
+    fprintf(stderr, "frames_backdrop %lu\n", stats.backdropFrames);
+    fprintf(stderr, "frames_withheld %lu (output blanked or covered)\n", stats.framesWithheld);
+    fprintf(stderr, "damage_pixels_per_frame %llu\n",
+            stats.frames ? stats.damagePixels / stats.frames : 0);
+    fprintf(stderr, "damage_rects_per_frame %.1f\n",
+            stats.frames ? (double) stats.damageRects / stats.frames : 0.0);
+    if (stats.frames) {
+        fprintf(stderr, "requests_per_frame %.1f\n", (double) stats.frameRequests / stats.frames);
+        fprintf(stderr, "clips_per_frame %.1f (%.1f dropped as redundant)\n",
+                (double) stats.clipsSet / stats.frames, (double) stats.clipsSkipped / stats.frames);
+        fprintf(stderr, "requests by opcode per frame, all traffic:\n");
+        print_requests(stats.frames);
+    }
+    if (frameBudget)
+        fprintf(stderr, "quality degraded %lu times, restored %lu, %.1f s degraded, "
+                        "frame average %.1f ms (budget %.1f)\n",
+                stats.degrades, stats.restores,
+                stats.degradedSeconds + (degraded ? elapsed(degradedAt) : 0),
+                frameAverage * 1000, frameBudget * 1000);
+    for (const histogram &h : latencyHist) {
+        char p50[32], p99[32];
+
+        if (!h.count)
+            continue;
+        fprintf(stderr, "damage_latency_ms %s: %lu frames, mean %.1f, p50 %s, p99 %s\n",
+                h.label, h.count, h.sum / h.count * 1000,
+                quantile_ms(p50, sizeof(p50), &h, 0.5), quantile_ms(p99, sizeof(p99), &h, 0.99));
+    }
+    funlockfile(stderr);
+}
+
+/* Listening socket for -M, or -1.  Each connection gets one snapshot in
+   the Prometheus text format and is closed, so a scraper just reads to
+   EOF.  Everything is non-blocking and serviced from the poll loop. */
+static thread_local int metricsFd = -1;
+static thread_local char metricsBuf[16384];
+
+static int
+open_metrics(const char *path) {
+    sockaddr_un addr{};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics socket path too long: %s\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    /* a stale socket from an earlier run would make bind fail */
+    unlink(path);
+    if (bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* header is False for the later members of a labelled family */
+static size_t
+format_hist(char *buf, size_t size, const histogram *h, Bool header) {
+    size_t len = 0;
+    unsigned long cumulative = 0;
+    char label[64] = "";
+    char labels[64] = "";
+
+    if (h->label) {
+        snprintf(label, sizeof(label), "{type=\"%s\"}", h->label);
+        snprintf(labels, sizeof(labels), "type=\"%s\",", h->label);
+    }
+    if (header)
+        len += snprintf(buf + len, size - len, "# HELP %s %s\n# TYPE %s histogram\n",
+                        h->name, h->help, h->name);
+    for (int i = 0; i < HIST_BUCKETS && len < size; i++) {
+        cumulative += h->counts[i];
+        len += snprintf(buf + len, size - len, "%s_bucket{%sle=\"%g\"} %lu\n",
+                        h->name, labels, h->bounds[i], cumulative);
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len, "%s_bucket{%sle=\"+Inf\"} %lu\n%s_sum%s %g\n%s_count%s %lu\n",
+                        h->name, labels, h->count, h->name, label, h->sum, h->name, label, h->count);
+    return len < size ? len : size;
+}
+
+static size_t
+format_metrics(char *buf, size_t size) {
+    static const char *const modeNames[] = {"solid", "trans", "argb"};
+    size_t len = 0;
+
+    len += snprintf(buf + len, size - len,
+                    "# HELP compander_frames_total Frames painted\n"
+                    "# TYPE compander_frames_total counter\n"
+                    "compander_frames_total %lu\n"
+                    "# HELP compander_frames_by_path_total Frames painted, by painting path\n"
+                    "# TYPE compander_frames_by_path_total counter\n"
+                    "compander_frames_by_path_total{path=\"clipped\"} %lu\n"
+                    "compander_frames_by_path_total{path=\"full\"} %lu\n"
+                    "# HELP compander_backdrop_frames_total Frames painted over the retained backdrop\n"
+                    "# TYPE compander_backdrop_frames_total counter\n"
+                    "compander_backdrop_frames_total %lu\n"
+                    "# HELP compander_windows_painted_total Windows painted, by mode\n"
+                    "# TYPE compander_windows_painted_total counter\n",
+                    stats.frames, stats.frames - stats.fullFrames, stats.fullFrames,
+                    stats.backdropFrames);
+    for (int m = 0; m < 3 && len < size; m++)
+        len += snprintf(buf + len, size - len, "compander_windows_painted_total{mode=\"%s\"} %llu\n",
+                        modeNames[m], stats.modeWins[m]);
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+                        "# HELP compander_clips_total Picture clips set or skipped as redundant\n"
+                        "# TYPE compander_clips_total counter\n"
+                        "compander_clips_total{result=\"set\"} %lu\n"
+                        "compander_clips_total{result=\"skipped\"} %lu\n"
+                        "# HELP compander_ignores Requests whose errors are waiting to be ignored\n"
+                        "# TYPE compander_ignores gauge\n"
+                        "compander_ignores %zu\n",
+                        stats.clipsSet, stats.clipsSkipped, ignoreCount);
+    if (frameBudget && len < size)
+        len += snprintf(buf + len, size - len,
+                        "# HELP compander_quality_changes_total Switches to degraded or full quality\n"
+                        "# TYPE compander_quality_changes_total counter\n"
+                        "compander_quality_changes_total{to=\"degraded\"} %lu\n"
+                        "compander_quality_changes_total{to=\"full\"} %lu\n"
+                        "# HELP compander_degraded_seconds_total Time spent at degraded quality\n"
+                        "# TYPE compander_degraded_seconds_total counter\n"
+                        "compander_degraded_seconds_total %.3f\n"
+                        "# HELP compander_degraded Whether quality is degraded now\n"
+                        "# TYPE compander_degraded gauge\n"
+                        "compander_degraded %d\n",
+                        stats.degrades, stats.restores,
+                        stats.degradedSeconds + (degraded ? elapsed(degradedAt) : 0), degraded ? 1 : 0);
+#if HAS_NAME_WINDOW_PIXMAP
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+                        "# HELP compander_pixmap_bytes Window pixmap memory held, estimated\n"
+                        "# TYPE compander_pixmap_bytes gauge\n"
+                        "compander_pixmap_bytes %ld\n"
+                        "# HELP compander_pixmaps_total Kept window pixmaps reused on map or evicted\n"
+                        "# TYPE compander_pixmaps_total counter\n"
+                        "compander_pixmaps_total{event=\"reused\"} %lu\n"
+                        "compander_pixmaps_total{event=\"evicted\"} %lu\n",
+                        pixmapTotal, stats.pixmapsReused, stats.pixmapsEvicted);
+#endif
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+                        "# HELP process_cpu_seconds_total User and system CPU time\n"
+                        "# TYPE process_cpu_seconds_total counter\n"
+                        "process_cpu_seconds_total %.3f\n"
+                        "# HELP compander_max_resident_bytes Peak resident set size\n"
+                        "# TYPE compander_max_resident_bytes gauge\n"
+                        "compander_max_resident_bytes %ld\n",
+                        ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6,
+                        ru.ru_maxrss * 1024);
+    for (const histogram *h : {&frameTimeHist, &batchHist, &damageHist, &requestHist}) {
+        if (len >= size)
+            break;
+        len += format_hist(buf + len, size - len, h, True);
+    }
+    for (int c = 0; c < LATENCY_CLASSES && len < size; c++)
+        len += format_hist(buf + len, size - len, &latencyHist[c], c == 0);
+    return len < size ? len : size;
+}
+
+static void
+serve_metrics() {
+    int client;
+
+    while ((client = accept4(metricsFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        size_t len = format_metrics(metricsBuf, sizeof(metricsBuf));
+        /* a fresh socket buffer holds the whole snapshot; a reader that
+           cannot take it gets it truncated rather than stalling a frame */
+        if (send(client, metricsBuf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN)
+            perror("metrics");
+        close(client);
+    }
+}
+
+/* windows whose opacity is fetched in one batch after the event queue drains */
+static thread_local std::vector<Window> opacityPending;
 
 /* find these once and be done with it */
 static Atom opacityAtom;
@@ -112,6 +729,8 @@ static Atom winUtilAtom;
 static Atom winSplashAtom;
 static Atom winDialogAtom;
 static Atom winNormalAtom;
+static Atom thumbnailAtom;
+static Atom backgroundAtoms[2];
 
 /* opacity property name; sometime soon I'll write up an EWMH spec for it */
 #define OPACITY_PROP    "_NET_WM_WINDOW_OPACITY"
@@ -129,9 +748,40 @@ static Atom winNormalAtom;
 #define DEBUG_EVENTS  0
 #define DEBUG_SHAPE   0
 #define MONITOR_REPAINT 0
+#define DEBUG_ALLOC   0
+
+#if DEBUG_ALLOC
+/* Counts every C++ heap allocation; the main loop asserts that painting
+   a frame adds none.  Xlib's own mallocs are not seen.  A window's first
+   paint after a map or resize may still size the shadow cache and the
+   scratch lists, so frames that create a window picture are let off. */
+static thread_local unsigned long allocations;
+static thread_local unsigned long windowPictures;
+
+void *
+operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) noexcept {
+    free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+#endif
 
 enum CompMode {
     CompSimple,        /* looks like a regular X server */
+    CompServerShadows,    /* use window alpha for shadow; sharp, but precise */
+    CompClientShadows,    /* use window extents for shadow, blurred */
 };
 
 static void
@@ -140,12 +790,40 @@ determine_mode(Display *dpy, win_it w);
 static double
 get_opacity_percent(Display *dpy, win_it w, double def);
 
-static XserverRegion
+static XRectangle
 win_extents(Display *dpy, win_it w);
 
+static void
+paint_heatmap(Display *dpy);
+
+static Bool
+mark_tiles(std::vector<unsigned char> &tiles, int x, int y, int width, int height);
+
+static Bool
+win_fading(win_it w);
+
 static CompMode compMode = CompSimple;
 
+static int shadowRadius = 12;
+static int shadowOffsetX = -15;
+static int shadowOffsetY = -15;
+static double shadowOpacity = .75;
+static Bool excludeDockShadows = False;
+
+/* shadow opacity is quantized to this many levels so tiles can be shared */
+#define SHADOW_LEVELS 25
+
+static Bool fadeWindows = False;
+static Bool fadeTrans = False;
+static int fade_delta = 10;
+static double fade_in_step = 0.028;
+static double fade_out_step = 0.03;
+
 static Bool autoRedirect = False;
+/* Hybrid mode (-H): the server composites the root's children on its
+   own, and only windows that need blending or a shape are redirected
+   manually and painted here, see update_redirect. */
+static Bool hybridRedirect = False;
 
 static Picture
 solid_picture(Display *dpy, Bool argb, double a, double r, double g, double b) {
@@ -175,28 +853,358 @@ solid_picture(Display *dpy, Bool argb, double a, double r, double g, double b) {
     return picture;
 }
 
+struct conv {
+    int size;
+    std::vector<double> data;
+};
+
+static conv gaussianMap;
+
+/* edge and corner tiles of the blurred shadow, for every opacity level */
+static std::vector<unsigned char> shadowCorner;
+static std::vector<unsigned char> shadowTop;
+static int Gsize = -1;
+
+static double
+gaussian(double r, double x, double y) {
+    return ((1 / (sqrt(2 * M_PI * r))) *
+            exp((-(x * x + y * y)) / (2 * r * r)));
+}
+
 static void
-discard_ignore(Display *dpy, unsigned long sequence) {
-    for(auto it = ignores.begin(); it != ignores.end(); it++) {
-        if(sequence - *it > 0) {
-            auto new_it = std::next(it);
-            ignores.erase(it);
-            it = new_it;
-        } else {
-            break;
+make_gaussian_map(double r) {
+    int size = ((int) ceil((r * 3)) + 1) & ~1;
+    int center = size / 2;
+    double t = 0.0;
+
+    gaussianMap.size = size;
+    gaussianMap.data.resize(size * size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double g = gaussian(r, (double) (x - center), (double) (y - center));
+            t += g;
+            gaussianMap.data[y * size + x] = g;
+        }
+    }
+    for (double &g : gaussianMap.data)
+        g /= t;
+}
+
+/*
+ * A picture will help
+ *
+ *	-center   0                width  width+center
+ *  -center +-----+-------------------+-----+
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *        0 +-----+-------------------+-----+
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *   height +-----+-------------------+-----+
+ *	    |     |                   |     |
+ * height+  |     |                   |     |
+ *  center  +-----+-------------------+-----+
+ */
+static unsigned char
+sum_gaussian(const conv &map, double opacity, int x, int y, int width, int height) {
+    int g_size = map.size;
+    int center = g_size / 2;
+    int fx_start, fx_end;
+    int fy_start, fy_end;
+    double v;
+
+    /*
+     * Compute set of filter values which are "in range",
+     * that's the set with:
+     *	0 <= x + (fx-center) && x + (fx-center) < width &&
+     *  0 <= y + (fy-center) && y + (fy-center) < height
+     *
+     *  0 <= x + (fx - center)	x + fx - center < width
+     *  center - x <= fx	fx < width + center - x
+     */
+    fx_start = center - x;
+    if (fx_start < 0)
+        fx_start = 0;
+    fx_end = width + center - x;
+    if (fx_end > g_size)
+        fx_end = g_size;
+
+    fy_start = center - y;
+    if (fy_start < 0)
+        fy_start = 0;
+    fy_end = height + center - y;
+    if (fy_end > g_size)
+        fy_end = g_size;
+
+    v = 0;
+    for (int fy = fy_start; fy < fy_end; fy++) {
+        const double *g_data = &map.data[fy * g_size + fx_start];
+        for (int fx = fx_start; fx < fx_end; fx++)
+            v += *g_data++;
+    }
+    if (v > 1)
+        v = 1;
+
+    return ((unsigned char) (v * opacity * 255.0));
+}
+
+/* precompute shadow corners and sides to save time for large windows */
+static void
+presum_gaussian(const conv &map) {
+    int center = map.size / 2;
+    int stride;
+
+    Gsize = map.size;
+    stride = Gsize + 1;
+
+    shadowCorner.assign(stride * stride * (SHADOW_LEVELS + 1), 0);
+    shadowTop.assign(stride * (SHADOW_LEVELS + 1), 0);
+
+    for (int x = 0; x <= Gsize; x++) {
+        shadowTop[SHADOW_LEVELS * stride + x] = sum_gaussian(map, 1, x - center, center, Gsize * 2, Gsize * 2);
+        for (int opacity = 0; opacity < SHADOW_LEVELS; opacity++)
+            shadowTop[opacity * stride + x] = shadowTop[SHADOW_LEVELS * stride + x] * opacity / SHADOW_LEVELS;
+        for (int y = 0; y <= x; y++) {
+            unsigned char d = sum_gaussian(map, 1, x - center, y - center, Gsize * 2, Gsize * 2);
+
+            shadowCorner[SHADOW_LEVELS * stride * stride + y * stride + x] = d;
+            shadowCorner[SHADOW_LEVELS * stride * stride + x * stride + y] = d;
+            for (int opacity = 0; opacity < SHADOW_LEVELS; opacity++) {
+                shadowCorner[opacity * stride * stride + y * stride + x] =
+                shadowCorner[opacity * stride * stride + x * stride + y] = d * opacity / SHADOW_LEVELS;
+            }
+        }
+    }
+}
+
+static XImage *
+make_shadow(Display *dpy, int level, int width, int height) {
+    XImage *ximage;
+    unsigned char *data;
+    double opacity = (double) level / SHADOW_LEVELS;
+    int gsize = gaussianMap.size;
+    int ylimit, xlimit;
+    int swidth = width + gsize;
+    int sheight = height + gsize;
+    int center = gsize / 2;
+    int stride = Gsize + 1;
+    unsigned char d;
+    int x_diff;
+
+    /* XDestroyImage frees this */
+    data = (unsigned char *) malloc(swidth * sheight * sizeof(unsigned char));
+    if (!data)
+        return nullptr;
+    ximage = XCreateImage(dpy,
+                          DefaultVisual (dpy, scr),
+                          8,
+                          ZPixmap,
+                          0,
+                          (char *) data,
+                          swidth, sheight, 8, swidth * sizeof(unsigned char));
+    if (!ximage) {
+        free(data);
+        return nullptr;
+    }
+    /*
+     * Build the gaussian in sections
+     */
+
+    /*
+     * center (fill the complete data array)
+     */
+    if (Gsize > 0)
+        d = shadowTop[level * stride + Gsize];
+    else
+        d = sum_gaussian(gaussianMap, opacity, center, center, width, height);
+    memset(data, d, sheight * swidth);
+
+    /*
+     * corners
+     */
+    ylimit = gsize;
+    if (ylimit > sheight / 2)
+        ylimit = (sheight + 1) / 2;
+    xlimit = gsize;
+    if (xlimit > swidth / 2)
+        xlimit = (swidth + 1) / 2;
+
+    for (int y = 0; y < ylimit; y++) {
+        for (int x = 0; x < xlimit; x++) {
+            if (xlimit == Gsize && ylimit == Gsize)
+                d = shadowCorner[level * stride * stride + y * stride + x];
+            else
+                d = sum_gaussian(gaussianMap, opacity, x - center, y - center, width, height);
+            data[y * swidth + x] = d;
+            data[(sheight - y - 1) * swidth + x] = d;
+            data[(sheight - y - 1) * swidth + (swidth - x - 1)] = d;
+            data[y * swidth + (swidth - x - 1)] = d;
+        }
+    }
+
+    /*
+     * top/bottom
+     */
+    x_diff = swidth - (gsize * 2);
+    if (x_diff > 0 && ylimit > 0) {
+        for (int y = 0; y < ylimit; y++) {
+            if (ylimit == Gsize)
+                d = shadowTop[level * stride + y];
+            else
+                d = sum_gaussian(gaussianMap, opacity, center, y - center, width, height);
+            memset(&data[y * swidth + gsize], d, x_diff);
+            memset(&data[(sheight - y - 1) * swidth + gsize], d, x_diff);
+        }
+    }
+
+    /*
+     * sides
+     */
+    for (int x = 0; x < xlimit; x++) {
+        if (xlimit == Gsize)
+            d = shadowTop[level * stride + x];
+        else
+            d = sum_gaussian(gaussianMap, opacity, x - center, center, width, height);
+        for (int y = gsize; y < sheight - gsize; y++) {
+            data[y * swidth + x] = d;
+            data[y * swidth + (swidth - x - 1)] = d;
+        }
+    }
+
+    return ximage;
+}
+
+static Picture
+shadow_picture(Display *dpy, int level, int width, int height, int *wp, int *hp) {
+    XImage *shadowImage;
+    Pixmap shadowPixmap;
+    Picture shadowPicture;
+    GC gc;
+
+    shadowImage = make_shadow(dpy, level, width, height);
+    if (!shadowImage)
+        return None;
+    shadowPixmap = XCreatePixmap(dpy, root,
+                                 shadowImage->width,
+                                 shadowImage->height,
+                                 8);
+    if (!shadowPixmap) {
+        XDestroyImage(shadowImage);
+        return None;
+    }
+
+    shadowPicture = XRenderCreatePicture(dpy, shadowPixmap,
+                                         XRenderFindStandardFormat(dpy, PictStandardA8),
+                                         0, nullptr);
+    if (!shadowPicture) {
+        XDestroyImage(shadowImage);
+        XFreePixmap(dpy, shadowPixmap);
+        return None;
+    }
+
+    gc = XCreateGC(dpy, shadowPixmap, 0, nullptr);
+    if (!gc) {
+        XDestroyImage(shadowImage);
+        XFreePixmap(dpy, shadowPixmap);
+        XRenderFreePicture(dpy, shadowPicture);
+        return None;
+    }
+
+    XPutImage(dpy, shadowPixmap, gc, shadowImage, 0, 0, 0, 0,
+              shadowImage->width,
+              shadowImage->height);
+    *wp = shadowImage->width;
+    *hp = shadowImage->height;
+    XFreeGC(dpy, gc);
+    XDestroyImage(shadowImage);
+    XFreePixmap(dpy, shadowPixmap);
+    return shadowPicture;
+}
+
+/* Shadow pictures are built once per (size, opacity level) and shared by
+   every window that matches, so equally sized terminals or menus upload
+   a single image between them.
+ */
+struct shadow_image {
+    int width;
+    int height;
+    int level;
+    Picture picture;
+    int shadow_width;
+    int shadow_height;
+    int refs;
+};
+
+static thread_local std::list<shadow_image> shadowCache;
+
+static Picture
+get_shadow(Display *dpy, int level, int width, int height, int *wp, int *hp) {
+    for (shadow_image &s : shadowCache) {
+        if (s.width == width && s.height == height && s.level == level) {
+            s.refs++;
+            *wp = s.shadow_width;
+            *hp = s.shadow_height;
+            return s.picture;
+        }
+    }
+
+    shadow_image s = {width, height, level, None, 0, 0, 1};
+    s.picture = shadow_picture(dpy, level, width, height, &s.shadow_width, &s.shadow_height);
+    if (!s.picture)
+        return None;
+    shadowCache.push_back(s);
+    *wp = s.shadow_width;
+    *hp = s.shadow_height;
+    return s.picture;
+}
+
+static void
+release_shadow(Display *dpy, Picture picture) {
+    for (auto it = shadowCache.begin(); it != shadowCache.end(); it++) {
+        if (it->picture == picture) {
+            if (--it->refs == 0) {
+                XRenderFreePicture(dpy, it->picture);
+                shadowCache.erase(it);
+            }
+            return;
         }
     }
 }
 
+static void
+discard_ignore(Display *dpy, unsigned long sequence) {
+    while (ignoreCount && (long) (sequence - ignores[ignoreHead]) > 0) {
+        ignoreHead = (ignoreHead + 1) % ignores.size();
+        ignoreCount--;
+    }
+}
+
 static void
 set_ignore(Display *dpy, unsigned long sequence) {
-    ignores.push_back(sequence);
+    if (ignoreCount == ignores.size()) {
+        /* unwrap into a buffer twice the size */
+        std::vector<unsigned long> grown(ignores.size() * 2);
+        for (size_t i = 0; i < ignoreCount; i++)
+            grown[i] = ignores[(ignoreHead + i) % ignores.size()];
+        ignores.swap(grown);
+        ignoreHead = 0;
+    }
+    ignores[(ignoreHead + ignoreCount) % ignores.size()] = sequence;
+    ignoreCount++;
 }
 
 static int
 should_ignore(Display *dpy, unsigned long sequence) {
     discard_ignore(dpy, sequence);
-    return !ignores.empty() && *ignores.begin() == sequence;
+    return ignoreCount && ignores[ignoreHead] == sequence;
+}
+
+/* requests sent through xcb carry their own cookie; a checked cookie
+   handed to this never reaches the error handler */
+static void
+discard_error(xcb_void_cookie_t cookie) {
+    xcb_discard_reply(xconn, cookie.sequence);
 }
 
 static win_it
@@ -209,57 +1217,85 @@ find_win(Window id) {
     return win_list.end();
 }
 
+/* xcb hands back visual ids; look them up in the screen info Xlib
+   already holds instead of asking the server */
+static Visual *
+find_visual(Display *dpy, VisualID id) {
+    Screen *s = ScreenOfDisplay (dpy, scr);
+
+    for (int d = 0; d < s->ndepths; d++) {
+        Depth *depth = &s->depths[d];
+        for (int v = 0; v < depth->nvisuals; v++) {
+            if (depth->visuals[v].visualid == id)
+                return &depth->visuals[v];
+        }
+    }
+    return nullptr;
+}
+
 static const char *backgroundProps[] = {
         "_XROOTPMAP_ID",
         "_XSETROOT_ID",
         nullptr,
 };
 
+/* The wallpaper, rendered once into a screen-sized picture so frames
+   composite a plain copy instead of repeating a tile of unknown size.
+   Rebuilt when a background property changes or the root is resized.
+ */
 static Picture
 root_tile(Display *dpy) {
     Picture picture;
-    Atom actual_type;
     Pixmap pixmap;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *prop;
-    Bool fill;
     XRenderPictureAttributes pa;
+    XRenderPictFormat *format = XRenderFindVisualFormat(dpy, DefaultVisual (dpy, scr));
+    xcb_get_property_cookie_t cookies[2];
     int p;
 
+    /* ask for every candidate property up front, take the first hit */
+    for (p = 0; backgroundProps[p]; p++)
+        cookies[p] = xcb_get_property(xconn, 0, root, backgroundAtoms[p], XCB_GET_PROPERTY_TYPE_ANY, 0, 4);
+
     pixmap = None;
     for (p = 0; backgroundProps[p]; p++) {
-        if (XGetWindowProperty(dpy, root, XInternAtom(dpy, backgroundProps[p], False),
-                               0, 4, False, AnyPropertyType,
-                               &actual_type, &actual_format, &nitems, &bytes_after, &prop) == Success &&
-            actual_type == XInternAtom(dpy, "PIXMAP", False) && actual_format == 32 && nitems == 1) {
-            memcpy(&pixmap, prop, 4);
-            XFree(prop);
-            fill = False;
-            break;
-        }
-    }
-    if (!pixmap) {
-        pixmap = XCreatePixmap(dpy, root, 1, 1, DefaultDepth (dpy, scr));
-        fill = True;
+        xcb_get_property_reply_t *reply = xcb_get_property_reply(xconn, cookies[p], nullptr);
+
+        if (!pixmap && reply && reply->type == XA_PIXMAP && reply->format == 32 &&
+            xcb_get_property_value_length(reply) == 4)
+            pixmap = *(uint32_t *) xcb_get_property_value(reply);
+        free(reply);
     }
-    pa.repeat = True;
-    picture = XRenderCreatePicture(dpy, pixmap,
-                                   XRenderFindVisualFormat(dpy,
-                                                           DefaultVisual (dpy, scr)),
-                                   CPRepeat, &pa);
-    if (fill) {
-        XRenderColor c;
 
-        c.red = c.green = c.blue = 0x8080;
-        c.alpha = 0xffff;
-        XRenderFillRectangle(dpy, PictOpSrc, picture, &c,
-                             0, 0, 1, 1);
+    Pixmap cache = XCreatePixmap(dpy, root, root_width, root_height, DefaultDepth (dpy, scr));
+    picture = XRenderCreatePicture(dpy, cache, format, 0, nullptr);
+    XFreePixmap(dpy, cache);
+    /* grey shows through wherever the wallpaper does not draw */
+    XRenderColor c;
+    c.red = c.green = c.blue = 0x8080;
+    c.alpha = 0xffff;
+    XRenderFillRectangle(dpy, PictOpSrc, picture, &c, 0, 0, root_width, root_height);
+    if (pixmap) {
+        /* the pixmap belongs to whoever set the wallpaper and may be gone */
+        pa.repeat = True;
+        set_ignore(dpy, NextRequest (dpy));
+        Picture tile = XRenderCreatePicture(dpy, pixmap, format, CPRepeat, &pa);
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderComposite(dpy, PictOpSrc, tile, None, picture,
+                         0, 0, 0, 0, 0, 0, root_width, root_height);
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderFreePicture(dpy, tile);
     }
     return picture;
 }
 
+static void
+free_root_tile(Display *dpy) {
+    if (rootTile) {
+        XRenderFreePicture(dpy, rootTile);
+        rootTile = None;
+    }
+}
+
 static void
 paint_root(Display *dpy) {
     if (!rootTile)
@@ -270,258 +1306,1601 @@ paint_root(Display *dpy) {
                      0, 0, 0, 0, 0, 0, root_width, root_height);
 }
 
-static XserverRegion
+static int
+shadow_level(const win *w) {
+    double opacity = shadowOpacity;
+
+    if (w->mode == WINDOW_TRANS)
+        opacity = opacity * ((double) w->opacity) / ((double) OPAQUE);
+    return (int) (opacity * SHADOW_LEVELS);
+}
+
+static Bool
+win_has_shadow(const win *w) {
+    if (compMode == CompSimple)
+        return False;
+    /* desktop windows are the background, nothing to cast a shadow on */
+    if (w->windowType == winDesktopAtom)
+        return False;
+    if (w->windowType == winDockAtom && excludeDockShadows)
+        return False;
+    /* nothing would paint the shadow of a window the server composites */
+    if (hybridRedirect && !w->redirected)
+        return False;
+    return compMode == CompServerShadows || w->mode != WINDOW_ARGB;
+}
+
+static XRectangle
 win_extents(Display *dpy, win_it w) {
     XRectangle r = {static_cast<short>(w->a.x),
                     static_cast<short>(w->a.y),
                     static_cast<unsigned short>(w->a.width + w->a.border_width * 2),
                     static_cast<unsigned short>(w->a.height + w->a.border_width * 2)};
-    return XFixesCreateRegion(dpy, &r, 1);
-}
 
-static XserverRegion
-border_size(Display *dpy, win_it w) {
-    XserverRegion border;
-    /*
-     * if window doesn't exist anymore,  this will generate an error
-     * as well as not generate a region.  Perhaps a better XFixes
-     * architecture would be to have a request that copies instead
-     * of creates, that way you'd just end up with an empty region
-     * instead of an invalid XID.
-     */
-    set_ignore(dpy, NextRequest (dpy));
-    border = XFixesCreateRegionFromWindow(dpy, w->id, WindowRegionBounding);
-    /* translate this */
-    set_ignore(dpy, NextRequest (dpy));
-    XFixesTranslateRegion(dpy, border,
-                          w->a.x + w->a.border_width,
-                          w->a.y + w->a.border_width);
-    return border;
+    if (win_has_shadow(&*w)) {
+        XRectangle sr;
+
+        if (compMode == CompServerShadows) {
+            w->shadow_dx = 2;
+            w->shadow_dy = 7;
+            w->shadow_width = w->a.width;
+            w->shadow_height = w->a.height;
+        } else {
+            w->shadow_dx = shadowOffsetX;
+            w->shadow_dy = shadowOffsetY;
+            if (!w->shadow) {
+                w->shadow_level = shadow_level(&*w);
+                w->shadow = get_shadow(dpy, w->shadow_level,
+                                       w->a.width + w->a.border_width * 2,
+                                       w->a.height + w->a.border_width * 2,
+                                       &w->shadow_width, &w->shadow_height);
+            }
+        }
+        sr.x = w->a.x + w->shadow_dx;
+        sr.y = w->a.y + w->shadow_dy;
+        sr.width = w->shadow_width;
+        sr.height = w->shadow_height;
+        if (sr.x < r.x) {
+            r.width = (r.x + r.width) - sr.x;
+            r.x = sr.x;
+        }
+        if (sr.y < r.y) {
+            r.height = (r.y + r.height) - sr.y;
+            r.y = sr.y;
+        }
+        if (sr.x + sr.width > r.x + r.width)
+            r.width = sr.x + sr.width - r.x;
+        if (sr.y + sr.height > r.y + r.height)
+            r.height = sr.y + sr.height - r.y;
+    }
+    return r;
 }
 
+/* the server region is what painting clips with, the rectangle is what
+   damage is computed from */
 static void
-paint_all(Display *dpy, XserverRegion region) {
+update_extents(Display *dpy, win_it w) {
+    w->extentsRect = win_extents(dpy, w);
+    w->extents = XFixesCreateRegion(dpy, &w->extentsRect, 1);
+}
 
-    if (!region) {
-        XRectangle r = {0, 0, static_cast<unsigned short>(root_width), static_cast<unsigned short>(root_height)};
-        region = XFixesCreateRegion(dpy, &r, 1);
+/* forget the window's border and extents, the next paint rebuilds them */
+static void
+free_regions(Display *dpy, win_it w) {
+    if (w->borderSize) {
+        set_ignore(dpy, NextRequest (dpy));
+        XFixesDestroyRegion(dpy, w->borderSize);
+        w->borderSize = None;
+    }
+    if (w->extents) {
+        XFixesDestroyRegion(dpy, w->extents);
+        w->extents = None;
+    }
+}
+
+static void
+free_shadow(Display *dpy, win_it w) {
+    if (w->shadow) {
+        release_shadow(dpy, w->shadow);
+        w->shadow = None;
+    }
+}
+
+/* Fetch the bounding shape.  Needed once per window, after that
+   ShapeNotify keeps the copy current. */
+static void
+fetch_shape(Display *dpy, win_it w) {
+    int bShaped, cShaped;
+    int xbs, ybs, xcs, ycs;
+    unsigned int wbs, hbs, wcs, hcs;
+
+    w->shapeKnown = True;
+    w->shapeRects.clear();
+    w->shaped = False;
+    /* the window may be gone before it is first painted */
+    set_ignore(dpy, NextRequest (dpy));
+    if (!XShapeQueryExtents(dpy, w->id, &bShaped, &xbs, &ybs, &wbs, &hbs,
+                            &cShaped, &xcs, &ycs, &wcs, &hcs) || !bShaped)
+        return;
+
+    int count, ordering;
+    set_ignore(dpy, NextRequest (dpy));
+    XRectangle *rects = XShapeGetRectangles(dpy, w->id, ShapeBounding, &count, &ordering);
+    if (!rects)
+        return;
+    w->shaped = True;
+    w->shapeRects.assign(rects, rects + count);
+    XFree(rects);
+}
+
+static Bool
+win_shaped(Display *dpy, win_it w) {
+    if (!w->shapeKnown)
+        fetch_shape(dpy, w);
+    return w->shaped;
+}
+
+/* Built from the cached shape, so it neither asks the server about the
+   window nor fails once it is gone.  The server moves it on screen,
+   copying the rectangles here would allocate in the frame. */
+static XserverRegion
+border_size(Display *dpy, win_it w) {
+    if (!win_shaped(dpy, w)) {
+        XRectangle r = {static_cast<short>(w->a.x),
+                        static_cast<short>(w->a.y),
+                        static_cast<unsigned short>(w->a.width + w->a.border_width * 2),
+                        static_cast<unsigned short>(w->a.height + w->a.border_width * 2)};
+        return XFixesCreateRegion(dpy, &r, 1);
+    }
+    XserverRegion border = XFixesCreateRegion(dpy, w->shapeRects.data(), w->shapeRects.size());
+    XFixesTranslateRegion(dpy, border, w->a.x + w->a.border_width, w->a.y + w->a.border_width);
+    return border;
+}
+
+/* A file manager's desktop window usually hides the root completely,
+   painting the wallpaper under it would only be overdraw. */
+static Bool
+desktop_covers_root(Display *dpy) {
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        if (w->windowType != winDesktopAtom || !w->damaged || w->mode != WINDOW_SOLID)
+            continue;
+        if (w->a.x <= 0 && w->a.y <= 0
+            && w->a.x + w->a.width + w->a.border_width * 2 >= root_width
+            && w->a.y + w->a.height + w->a.border_width * 2 >= root_height
+            && !win_shaped(dpy, w))
+            return True;
+    }
+    return False;
+}
+
+#if HAS_NAME_WINDOW_PIXMAP
+static long
+pixmap_bytes(win_it w) {
+    long width = w->a.width + w->a.border_width * 2;
+    long height = w->a.height + w->a.border_width * 2;
+
+    return width * height * (w->a.depth > 16 ? 4 : w->a.depth > 8 ? 2 : 1);
+}
+#endif
+
+static Picture
+win_picture(Display *dpy, win_it w) {
+    XRenderPictureAttributes pa;
+    XRenderPictFormat *format;
+    Drawable draw = w->id;
+
+#if HAS_NAME_WINDOW_PIXMAP
+    if (hasNamePixmap && !w->pixmap) {
+        w->pixmap = XCompositeNameWindowPixmap(dpy, w->id);
+        w->pixmapBytes = pixmap_bytes(w);
+        pixmapTotal += w->pixmapBytes;
+    }
+    if (w->pixmap)
+        draw = w->pixmap;
+#endif
+#if DEBUG_ALLOC
+    windowPictures++;
+#endif
+    format = XRenderFindVisualFormat(dpy, w->a.visual);
+    pa.subwindow_mode = IncludeInferiors;
+    return XRenderCreatePicture(dpy, draw,
+                                format,
+                                CPSubwindowMode,
+                                &pa);
+}
+
+/* Drop the window's picture and, with it, its pixmap; the next paint
+   names a fresh one. */
+static void
+release_pixmap(Display *dpy, win_it w) {
+    if (w->picture) {
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderFreePicture(dpy, w->picture);
+        w->picture = None;
+    }
+#if HAS_NAME_WINDOW_PIXMAP
+    if (w->pixmap) {
+        XFreePixmap(dpy, w->pixmap);
+        w->pixmap = None;
+        pixmapTotal -= w->pixmapBytes;
+        w->pixmapBytes = 0;
+    }
+    w->stale = False;
+#endif
+    if (w->thumbSource) {
+        XRenderFreePicture(dpy, w->thumbSource);
+        w->thumbSource = None;
+    }
+}
+
+#if HAS_NAME_WINDOW_PIXMAP
+/* Evict least recently painted pixmaps until the budget holds.  Only
+   unmapped windows and windows entirely off the screen qualify, the
+   others would just be named again for the next frame.  Runs between
+   frames, never while a paint pass holds on to the pictures.
+ */
+static void
+trim_pixmaps(Display *dpy) {
+    while (pixmapTotal > pixmapBudget) {
+        win_it victim = win_list.end();
+
+        for (auto w = win_list.begin(); w != win_list.end(); w++) {
+            if (!w->pixmap)
+                continue;
+            if (w->a.map_state == IsViewable
+                && w->a.x + w->a.width + w->a.border_width * 2 >= 1
+                && w->a.y + w->a.height + w->a.border_width * 2 >= 1
+                && w->a.x < root_width && w->a.y < root_height)
+                continue;
+            /* fading out it is still painted, and an unmapped window's
+               pixmap can not be named again */
+            if (win_fading(w))
+                continue;
+            if (victim == win_list.end() || w->lastUsed < victim->lastUsed)
+                victim = w;
+        }
+        if (victim == win_list.end())
+            return;
+        release_pixmap(dpy, victim);
+        stats.pixmapsEvicted++;
+    }
+}
+#endif
+
+/* Thumbnails (-T size): every window keeps a copy scaled to fit in
+   size x size, published as pixmap, width and height in the window's
+   _COMPANDER_THUMBNAIL property; these are the root's children, so
+   frames under a reparenting window manager.  Damage only marks the bounding box
+   dirty; at most every THUMBNAIL_INTERVAL the dirty parts are scaled
+   over with a bilinear filter.  Thumbnails outlive unmaps, which is when
+   a pager wants them most.
+ */
+#define THUMBNAIL_INTERVAL 0.25
+
+static int thumbnailSize;
+static thread_local Bool thumbnailsDirty;
+static thread_local timespec thumbnailsUpdated;
+
+static void
+thumb_damage(win_it w, int x, int y, int width, int height) {
+    XRectangle &d = w->thumbDirty;
+
+    if (!thumbnailSize || width <= 0 || height <= 0)
+        return;
+    if (d.width && d.height) {
+        int x1 = d.x + d.width > x + width ? d.x + d.width : x + width;
+        int y1 = d.y + d.height > y + height ? d.y + d.height : y + height;
+        x = d.x < x ? d.x : x;
+        y = d.y < y ? d.y : y;
+        width = x1 - x;
+        height = y1 - y;
+    }
+    d = {static_cast<short>(x), static_cast<short>(y),
+         static_cast<unsigned short>(width), static_cast<unsigned short>(height)};
+    thumbnailsDirty = True;
+}
+
+static void
+free_thumbnail(Display *dpy, win_it w) {
+    if (w->thumbPicture) {
+        XRenderFreePicture(dpy, w->thumbPicture);
+        w->thumbPicture = None;
+    }
+    if (w->thumbPixmap) {
+        XFreePixmap(dpy, w->thumbPixmap);
+        w->thumbPixmap = None;
+    }
+    if (w->thumbSource) {
+        XRenderFreePicture(dpy, w->thumbSource);
+        w->thumbSource = None;
+    }
+}
+
+static void
+update_thumbnail(Display *dpy, win_it w) {
+    int width = w->a.width + w->a.border_width * 2;
+    int height = w->a.height + w->a.border_width * 2;
+    double scale = (double) thumbnailSize / (width > height ? width : height);
+    XRenderPictFormat *format = XRenderFindVisualFormat(dpy, w->a.visual);
+
+    if (scale > 1)
+        scale = 1;
+    if (!w->thumbPicture) {
+        w->thumbWidth = (int) ceil(width * scale);
+        w->thumbHeight = (int) ceil(height * scale);
+        w->thumbPixmap = XCreatePixmap(dpy, root, w->thumbWidth, w->thumbHeight, w->a.depth);
+        w->thumbPicture = XRenderCreatePicture(dpy, w->thumbPixmap, format, 0, nullptr);
+        w->thumbDirty = {0, 0, static_cast<unsigned short>(width), static_cast<unsigned short>(height)};
+
+        long prop[3] = {(long) w->thumbPixmap, w->thumbWidth, w->thumbHeight};
+        set_ignore(dpy, NextRequest (dpy));
+        XChangeProperty(dpy, w->id, thumbnailAtom, XA_CARDINAL, 32, PropModeReplace,
+                        (unsigned char *) prop, 3);
+    }
+    if (!w->thumbSource) {
+        XRenderPictureAttributes pa;
+        Drawable draw = w->id;
+        XTransform t = {{{XDoubleToFixed(1 / scale), 0, 0},
+                         {0, XDoubleToFixed(1 / scale), 0},
+                         {0, 0, XDoubleToFixed(1)}}};
+
+#if HAS_NAME_WINDOW_PIXMAP
+        if (w->pixmap)
+            draw = w->pixmap;
+#endif
+        pa.subwindow_mode = IncludeInferiors;
+        set_ignore(dpy, NextRequest (dpy));
+        w->thumbSource = XRenderCreatePicture(dpy, draw, format, CPSubwindowMode, &pa);
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderSetPictureFilter(dpy, w->thumbSource, FilterBilinear, nullptr, 0);
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderSetPictureTransform(dpy, w->thumbSource, &t);
+    }
+
+    /* the dirty box in thumbnail space, grown by a pixel for the filter */
+    const XRectangle &d = w->thumbDirty;
+    int x0 = (int) floor(d.x * scale) - 1, y0 = (int) floor(d.y * scale) - 1;
+    int x1 = (int) ceil((d.x + d.width) * scale) + 1, y1 = (int) ceil((d.y + d.height) * scale) + 1;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > w->thumbWidth ? w->thumbWidth : x1;
+    y1 = y1 > w->thumbHeight ? w->thumbHeight : y1;
+    if (x1 > x0 && y1 > y0) {
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderComposite(dpy, PictOpSrc, w->thumbSource, None, w->thumbPicture,
+                         x0, y0, 0, 0, x0, y0, x1 - x0, y1 - y0);
+    }
+    w->thumbDirty = {0, 0, 0, 0};
+}
+
+/* Called between frames; returns the milliseconds until thumbnails are
+   due again, or -1 when none are waiting. */
+static int
+update_thumbnails(Display *dpy) {
+    if (!thumbnailsDirty)
+        return -1;
+    double since = elapsed(thumbnailsUpdated);
+    if (since < THUMBNAIL_INTERVAL)
+        return (int) ((THUMBNAIL_INTERVAL - since) * 1000) + 1;
+
+    thumbnailsDirty = False;
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        if (!w->thumbDirty.width || !w->thumbDirty.height)
+            continue;
+        /* without contents to scale from, leave it to the first damage
+           after the next map, which covers the whole window */
+#if HAS_NAME_WINDOW_PIXMAP
+        if (!w->pixmap && !w->damaged) {
+#else
+        if (!w->damaged) {
+#endif
+            w->thumbDirty = {0, 0, 0, 0};
+            continue;
+        }
+        update_thumbnail(dpy, w);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &thumbnailsUpdated);
+    return thumbnailsDirty ? (int) (THUMBNAIL_INTERVAL * 1000) : -1;
+}
+
+static void
+paint_shadow(Display *dpy, win *w) {
+    switch (compMode) {
+        case CompSimple:
+            break;
+        case CompServerShadows:
+            if (!win_has_shadow(w))
+                break;
+            if (w->opacity != OPAQUE && !w->shadowPict)
+                w->shadowPict = solid_picture(dpy, True,
+                                              (double) w->opacity / OPAQUE * 0.3,
+                                              0, 0, 0);
+            set_ignore(dpy, NextRequest (dpy));
+            XRenderComposite(dpy, PictOpOver,
+                             w->shadowPict ? w->shadowPict : transBlackPicture,
+                             w->picture, rootBuffer,
+                             0, 0, 0, 0,
+                             w->a.x + w->shadow_dx,
+                             w->a.y + w->shadow_dy,
+                             w->shadow_width, w->shadow_height);
+            break;
+        case CompClientShadows:
+            if (w->shadow && win_has_shadow(w)) {
+                XRenderComposite(dpy, PictOpOver, blackPicture, w->shadow, rootBuffer,
+                                 0, 0, 0, 0,
+                                 w->a.x + w->shadow_dx,
+                                 w->a.y + w->shadow_dy,
+                                 w->shadow_width, w->shadow_height);
+            }
+            break;
+    }
+}
+
+#define MOVE_SETTLE    0.25    /* seconds without a move that end a drag */
+
+/* Under overload translucent windows are painted opaque, and so are
+   ARGB windows while they are dragged around. */
+static int
+paint_mode(win *w) {
+    if (!degraded || w->mode == WINDOW_SOLID)
+        return w->mode;
+    if (w->mode == WINDOW_ARGB && elapsed(w->movedAt) >= MOVE_SETTLE)
+        return WINDOW_ARGB;
+    if (w->mode == WINDOW_ARGB)
+        w->blendSkipped = True;
+    return WINDOW_SOLID;
+}
+
+/* what lies below the windows painted: base, or else the root */
+static void
+paint_base(Display *dpy, Picture base) {
+    if (base)
+        XRenderComposite(dpy, PictOpSrc, base, None, rootBuffer,
+                         0, 0, 0, 0, 0, 0, root_width, root_height);
+    else if (!desktop_covers_root(dpy))
+        paint_root(dpy);
+}
+
+/* Regular path: clip every window against everything above it, so each
+   pixel is painted once by the topmost opaque window covering it.
+   Paints the windows from first up to last over base.
+ */
+static void
+paint_windows(Display *dpy, XserverRegion region, win_it first, win_it last, Picture base) {
+    /* top to bottom; kept between frames so painting does not allocate */
+    static thread_local std::vector<win *> transparent;
+
+    transparent.clear();
+    for (auto w = first; w != last; w++) {
+#if CAN_DO_USABLE
+        if (!w->usable)
+        continue;
+#endif
+        /* never painted, ignores it */
+        if (!w->damaged)
+            continue;
+        /* if invisible, ignores it */
+        if (w->a.x + w->a.width < 1 || w->a.y + w->a.height < 1
+            || w->a.x >= root_width || w->a.y >= root_height)
+            continue;
+        if (!w->picture)
+            w->picture = win_picture(dpy, w);
+#if DEBUG_REPAINT
+        printf (" 0x%x", w->id);
+#endif
+        if (!w->borderSize)
+            w->borderSize = border_size(dpy, w);
+        if (!w->extents)
+            update_extents(dpy, w);
+
+        /* taken before a solid window removes itself from the region, so
+           the one clip serves its shadow and, painted over it, its body */
+        if (!w->borderClip) {
+            w->borderClip = XFixesCreateRegion(dpy, nullptr, 0);
+            XFixesCopyRegion(dpy, w->borderClip, region);
+            /* the extents also cover the shadow, which lies outside the border */
+            XFixesIntersectRegion(dpy, w->borderClip, w->borderClip,
+                                  win_has_shadow(&*w) ? w->extents : w->borderSize);
+        }
+        w->paintMode = paint_mode(&*w);
+        if (w->paintMode == WINDOW_SOLID) {
+            set_ignore(dpy, NextRequest (dpy));
+            XFixesSubtractRegion(dpy, region, region, w->borderSize);
+            forget_clip_region(region);
+        }
+        transparent.push_back(&*w);
+    }
+#if DEBUG_REPAINT
+    printf ("\n");
+    fflush (stdout);
+#endif
+    set_clip(dpy, rootBuffer, region);
+    paint_base(dpy, base);
+    for (auto it = transparent.rbegin(); it != transparent.rend(); it++) {
+        win *w = *it;
+        int x, y, wid, hei;
+
+        set_clip(dpy, rootBuffer, w->borderClip);
+        paint_shadow(dpy, w);
+        /* a shaped window is undefined outside its shape */
+        if (w->shaped && win_has_shadow(w)) {
+            XFixesIntersectRegion(dpy, w->borderClip, w->borderClip, w->borderSize);
+            forget_clip_region(w->borderClip);
+            set_clip(dpy, rootBuffer, w->borderClip);
+        }
+        if (w->opacity != OPAQUE && !w->alphaPict)
+            w->alphaPict = solid_picture(dpy, False,
+                                         (double) w->opacity / OPAQUE, 0, 0, 0);
+#if HAS_NAME_WINDOW_PIXMAP
+        x = w->a.x;
+        y = w->a.y;
+        wid = w->a.width + w->a.border_width * 2;
+        hei = w->a.height + w->a.border_width * 2;
+#else
+        x = w->a.x + w->a.border_width;
+        y = w->a.y + w->a.border_width;
+        wid = w->a.width;
+        hei = w->a.height;
+#endif
+        stats.modeWins[w->paintMode]++;
+        w->lastUsed = stats.frames;
+        set_ignore(dpy, NextRequest (dpy));
+        if (w->paintMode == WINDOW_SOLID)
+            XRenderComposite(dpy, PictOpSrc, w->picture, None, rootBuffer,
+                             0, 0, 0, 0,
+                             x, y, wid, hei);
+        else
+            XRenderComposite(dpy, PictOpOver, w->picture, w->alphaPict, rootBuffer,
+                             0, 0, 0, 0,
+                             x, y, wid, hei);
+        destroy_region(dpy, w->borderClip);
+        w->borderClip = None;
+    }
+}
+
+/* When damage covers most of the screen the region arithmetic of
+   paint_windows costs more than the overdraw it saves, so paint back to
+   front under the one damage clip.  Only shaped windows still need a
+   clip of their own, their pixmap is undefined outside the shape.
+ */
+static void
+paint_windows_full(Display *dpy, XserverRegion region, win_it first, win_it last, Picture base) {
+    set_clip(dpy, rootBuffer, region);
+    paint_base(dpy, base);
+    for (auto it = last; it != first;) {
+        win_it w = --it;
+        int x, y, wid, hei;
+
+        /* never painted, ignores it */
+        if (!w->damaged)
+            continue;
+        /* if invisible, ignores it */
+        if (w->a.x + w->a.width < 1 || w->a.y + w->a.height < 1
+            || w->a.x >= root_width || w->a.y >= root_height)
+            continue;
+        if (!w->picture)
+            w->picture = win_picture(dpy, w);
+        /* the extents still have to follow the window, damage relies on them */
+        if (!w->extents)
+            update_extents(dpy, w);
+
+        if (win_shaped(dpy, w)) {
+            if (!w->borderSize)
+                w->borderSize = border_size(dpy, w);
+            w->borderClip = XFixesCreateRegion(dpy, nullptr, 0);
+            XFixesIntersectRegion(dpy, w->borderClip, region,
+                                  win_has_shadow(&*w) ? w->extents : w->borderSize);
+            set_clip(dpy, rootBuffer, w->borderClip);
+        }
+        paint_shadow(dpy, &*w);
+        /* the shadow needed the extents, the body only gets the shape */
+        if (w->borderClip && win_has_shadow(&*w)) {
+            XFixesIntersectRegion(dpy, w->borderClip, w->borderClip, w->borderSize);
+            forget_clip_region(w->borderClip);
+            set_clip(dpy, rootBuffer, w->borderClip);
+        }
+        if (w->opacity != OPAQUE && !w->alphaPict)
+            w->alphaPict = solid_picture(dpy, False,
+                                         (double) w->opacity / OPAQUE, 0, 0, 0);
+#if HAS_NAME_WINDOW_PIXMAP
+        x = w->a.x;
+        y = w->a.y;
+        wid = w->a.width + w->a.border_width * 2;
+        hei = w->a.height + w->a.border_width * 2;
+#else
+        x = w->a.x + w->a.border_width;
+        y = w->a.y + w->a.border_width;
+        wid = w->a.width;
+        hei = w->a.height;
+#endif
+        w->paintMode = paint_mode(&*w);
+        stats.modeWins[w->paintMode]++;
+        w->lastUsed = stats.frames;
+        set_ignore(dpy, NextRequest (dpy));
+        XRenderComposite(dpy, w->paintMode == WINDOW_SOLID ? PictOpSrc : PictOpOver,
+                         w->picture, w->paintMode == WINDOW_SOLID ? None : w->alphaPict, rootBuffer,
+                         0, 0, 0, 0,
+                         x, y, wid, hei);
+        if (w->borderClip) {
+            destroy_region(dpy, w->borderClip);
+            w->borderClip = None;
+            set_clip(dpy, rootBuffer, region);
+        }
+    }
+}
+
+/* Frame export (-E): rootBuffer lives in a MIT-SHM pixmap, so the server
+   renders every frame straight into memory that readers can map.  The
+   segment id is published in _COMPANDER_FRAME_SHM on the root window;
+   the segment starts with a frame_export header and the pixels follow
+   at pixelOffset.  The header is a seqlock: sequence is odd while a frame
+   is being painted.  Each finished frame leaves its damage rectangles in
+   ring[sequence / 2 % FRAME_RING], so a reader that is fewer than
+   FRAME_RING frames behind copies just the union of what it missed.
+ */
+#define FRAME_MAGIC 0x46504d43    /* "CMPF" */
+#define FRAME_RING 8
+
+struct frame_damage {
+    uint64_t sequence;    /* of the finished frame, even */
+    uint32_t nrects;
+    struct {
+        int16_t x, y;
+        uint16_t width, height;
+    } rects[MAX_DAMAGE_RECTS];
+};
+
+struct frame_export {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t stride;    /* bytes per row */
+    uint32_t bitsPerPixel;
+    uint32_t redMask, greenMask, blueMask;
+    uint32_t pixelOffset;
+    uint64_t sequence;
+    frame_damage ring[FRAME_RING];
+};
+
+static Bool exportFrames;
+static thread_local XShmSegmentInfo exportShm;
+static thread_local frame_export *exportHeader;
+static thread_local Pixmap exportPixmap;
+
+static void
+close_export(Display *dpy) {
+    if (!exportHeader)
+        return;
+    XFreePixmap(dpy, exportPixmap);
+    XShmDetach(dpy, &exportShm);
+    XSync(dpy, False);
+    shmdt(exportShm.shmaddr);
+    exportHeader = nullptr;
+    exportPixmap = None;
+}
+
+/* A segment for the current root size, with rootBuffer's pixmap in it */
+static Bool
+open_export(Display *dpy) {
+    int depth = DefaultDepth (dpy, scr);
+    int count, bpp = 0, pad = 32;
+    XPixmapFormatValues *formats = XListPixmapFormats(dpy, &count);
+    Visual *visual = DefaultVisual (dpy, scr);
+
+    for (int i = 0; formats && i < count; i++) {
+        if (formats[i].depth == depth) {
+            bpp = formats[i].bits_per_pixel;
+            pad = formats[i].scanline_pad;
+        }
+    }
+    XFree(formats);
+    if (!bpp || XShmPixmapFormat(dpy) != ZPixmap) {
+        fprintf(stderr, "Server can't place pixmaps in shared memory, no frame export\n");
+        return False;
+    }
+
+    uint32_t stride = (root_width * bpp + pad - 1) / pad * pad / 8;
+    size_t offset = (sizeof(frame_export) + 4095) & ~(size_t) 4095;
+    exportShm.shmid = shmget(IPC_PRIVATE, offset + (size_t) stride * root_height, IPC_CREAT | 0600);
+    if (exportShm.shmid < 0) {
+        perror("shmget");
+        return False;
+    }
+    exportShm.shmaddr = (char *) shmat(exportShm.shmid, nullptr, 0);
+    exportShm.readOnly = False;
+    if (exportShm.shmaddr == (char *) -1 || !XShmAttach(dpy, &exportShm)) {
+        perror("shmat");
+        shmctl(exportShm.shmid, IPC_RMID, nullptr);
+        return False;
+    }
+    XSync(dpy, False);
+    /* Linux still lets readers attach once it is marked, and it goes
+       away with the last user even if we do not exit cleanly */
+    shmctl(exportShm.shmid, IPC_RMID, nullptr);
+
+    exportHeader = (frame_export *) exportShm.shmaddr;
+    memset(exportHeader, 0, sizeof(*exportHeader));
+    exportHeader->magic = FRAME_MAGIC;
+    exportHeader->version = 1;
+    exportHeader->width = root_width;
+    exportHeader->height = root_height;
+    exportHeader->stride = stride;
+    exportHeader->bitsPerPixel = bpp;
+    exportHeader->redMask = visual->red_mask;
+    exportHeader->greenMask = visual->green_mask;
+    exportHeader->blueMask = visual->blue_mask;
+    exportHeader->pixelOffset = offset;
+    exportPixmap = XShmCreatePixmap(dpy, root, exportShm.shmaddr + offset, &exportShm,
+                                    root_width, root_height, depth);
+
+    Atom shmAtom = XInternAtom(dpy, "_COMPANDER_FRAME_SHM", False);
+    long id = exportShm.shmid;
+    XChangeProperty(dpy, root, shmAtom, XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *) &id, 1);
+    return True;
+}
+
+/* the pixels are about to change */
+static void
+export_begin() {
+    if (exportHeader)
+        __atomic_store_n(&exportHeader->sequence, exportHeader->sequence | 1, __ATOMIC_RELEASE);
+}
+
+/* call once the server is done with the frame, after the XSync */
+static void
+export_end() {
+    if (!exportHeader)
+        return;
+    uint64_t sequence = (exportHeader->sequence | 1) + 1;
+    frame_damage &d = exportHeader->ring[sequence / 2 % FRAME_RING];
+
+    d.nrects = frameRects.size() < MAX_DAMAGE_RECTS ? frameRects.size() : MAX_DAMAGE_RECTS;
+    for (uint32_t i = 0; i < d.nrects; i++) {
+        d.rects[i].x = frameRects[i].x;
+        d.rects[i].y = frameRects[i].y;
+        d.rects[i].width = frameRects[i].width;
+        d.rects[i].height = frameRects[i].height;
+    }
+    d.sequence = sequence;
+    __atomic_store_n(&exportHeader->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+/* Retained backdrop: once a window has been damaged in BACKDROP_STREAK
+   frames in a row, it becomes the layer.  Frames then start from the
+   backdrop, and only the layer and the windows above it are painted
+   again.  Damage the layer and the windows above report leaves the
+   backdrop alone.  Any other damage also marks backdropTiles, and a
+   stale tile is brought up to date when a frame next paints over it.
+   Only layers that let something below show through are worth it.
+ */
+#define BACKDROP_STREAK    8
+
+/* the layer while painting, when backdrop is set */
+static thread_local win_it layer;
+/* stale backdrop under this frame */
+static thread_local std::vector<XRectangle> backdropRects;
+
+static void
+free_backdrop(Display *dpy) {
+    if (backdrop) {
+        forget_clip_picture(backdrop);
+        XRenderFreePicture(dpy, backdrop);
+        backdrop = None;
+    }
+    backdropLayer = None;
+}
+
+/* Called before the damage is turned into a frame. */
+static void
+update_backdrop(Display *dpy) {
+    win_it top = win_list.end();
+
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        if (w->a.map_state != IsViewable || w->damageStreak < BACKDROP_STREAK
+            || w->damageFrame + 1 < stats.frames)
+            continue;
+        if (w->mode != WINDOW_SOLID || win_has_shadow(&*w))
+            top = w;
+        break;
+    }
+    if (top == win_list.end()) {
+        free_backdrop(dpy);
+        return;
+    }
+    if (!backdrop) {
+        Pixmap pixmap = XCreatePixmap(dpy, root, root_width, root_height,
+                                      DefaultDepth (dpy, scr));
+        backdrop = XRenderCreatePicture(dpy, pixmap,
+                                        XRenderFindVisualFormat(dpy, DefaultVisual (dpy, scr)),
+                                        0, nullptr);
+        XFreePixmap(dpy, pixmap);
+    }
+    if (top->id != backdropLayer) {
+        backdropLayer = top->id;
+        backdropTiles.assign(tilesX * tilesY, 1);
+    }
+    layer = top;
+    Bool above = True;
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        w->aboveLayer = above;
+        if (w == top)
+            above = False;
+    }
+
+}
+
+/* Repaint every stale tile the frame covers.  The frame's rectangles
+   may have been merged past the damaged tiles, and whatever they cover
+   is copied from the backdrop, so they are what counts. */
+static void
+refresh_backdrop(Display *dpy) {
+    static thread_local std::vector<unsigned char> covered;
+
+    covered.assign(backdropTiles.size(), 0);
+    for (const XRectangle &r : frameRects)
+        mark_tiles(covered, r.x, r.y, r.width, r.height);
+
+    backdropRects.clear();
+    for (int ty = 0; ty < tilesY; ty++) {
+        int y = ty * DAMAGE_TILE;
+        int height = y + DAMAGE_TILE > root_height ? root_height - y : DAMAGE_TILE;
+
+        for (int tx = 0; tx < tilesX;) {
+            int t = ty * tilesX + tx;
+            if (!covered[t] || !backdropTiles[t]) {
+                tx++;
+                continue;
+            }
+            int x = tx * DAMAGE_TILE;
+            while (tx < tilesX && covered[ty * tilesX + tx] && backdropTiles[ty * tilesX + tx])
+                backdropTiles[ty * tilesX + tx++] = 0;
+            int x1 = tx * DAMAGE_TILE > root_width ? root_width : tx * DAMAGE_TILE;
+            backdropRects.push_back({
+                static_cast<short>(x), static_cast<short>(y),
+                static_cast<unsigned short>(x1 - x), static_cast<unsigned short>(height)
+            });
+        }
+    }
+    if (backdropRects.empty())
+        return;
+    XserverRegion region = XFixesCreateRegion(dpy, backdropRects.data(), backdropRects.size());
+    Picture buffer = rootBuffer;
+
+    rootBuffer = backdrop;
+    paint_windows(dpy, region, std::next(layer), win_list.end(), None);
+    rootBuffer = buffer;
+    destroy_region(dpy, region);
+}
+
+/* region is consumed; area is the number of pixels it covers */
+static void
+paint_all(Display *dpy, XserverRegion region, long area) {
+    unsigned long firstRequest = NextRequest (dpy);
+
+    if (!region) {
+        XRectangle r = {0, 0, static_cast<unsigned short>(root_width), static_cast<unsigned short>(root_height)};
+        region = XFixesCreateRegion(dpy, &r, 1);
+        area = (long) root_width * root_height;
+        frameRects.assign(1, r);
     }
 #if MONITOR_REPAINT
     rootBuffer = rootPicture;
 #else
     if (!rootBuffer) {
-        Pixmap rootPixmap = XCreatePixmap(dpy, root, root_width, root_height,
-                                          DefaultDepth (dpy, scr));
+        Pixmap rootPixmap;
+
+        if (exportFrames) {
+            close_export(dpy);
+            if (!open_export(dpy))
+                exit(1);
+        }
+        if (exportPixmap)
+            rootPixmap = exportPixmap;
+        else
+            rootPixmap = XCreatePixmap(dpy, root, root_width, root_height,
+                                       DefaultDepth (dpy, scr));
         rootBuffer = XRenderCreatePicture(dpy, rootPixmap,
                                           XRenderFindVisualFormat(dpy,
                                                                   DefaultVisual (dpy, scr)),
                                           0, nullptr);
-        XFreePixmap(dpy, rootPixmap);
+        if (!exportPixmap)
+            XFreePixmap(dpy, rootPixmap);
+    }
+#endif
+    set_clip(dpy, rootPicture, region);
+#if MONITOR_REPAINT
+    XRenderComposite (dpy, PictOpSrc, blackPicture, None, rootPicture,
+              0, 0, 0, 0, 0, 0, root_width, root_height);
+#endif
+#if DEBUG_REPAINT
+    printf ("paint:");
+#endif
+
+    win_it last = win_list.end();
+    if (backdrop) {
+        refresh_backdrop(dpy);
+        last = std::next(layer);
+        stats.backdropFrames++;
+    }
+    stats.frames++;
+    stats.damagePixels += area;
+    if (area >= fullRepaintFraction * root_width * root_height) {
+        stats.fullFrames++;
+        paint_windows_full(dpy, region, win_list.begin(), last, backdrop);
+    } else {
+        paint_windows(dpy, region, win_list.begin(), last, backdrop);
+    }
+    if (heatmap)
+        paint_heatmap(dpy);
+    destroy_region(dpy, region);
+    if (rootBuffer != rootPicture) {
+        set_clip(dpy, rootBuffer, None);
+        XRenderComposite(dpy, PictOpSrc, rootBuffer, None, rootPicture,
+                         0, 0, 0, 0, 0, 0, root_width, root_height);
+    }
+    stats.frameRequests += NextRequest (dpy) - firstRequest;
+    hist_add(&damageHist, area);
+    hist_add(&requestHist, NextRequest (dpy) - firstRequest);
+}
+
+/* Capture mode (-W): frames are composited into a pixmap of our own
+   instead of the root window, and the damaged part of every captureEvery
+   frame is written out as a PPM.  Every frame gets a line in the log:
+   number, seconds from damage to XSync, damaged pixels, rectangles, the
+   bounding box and the file written, if any.
+ */
+static const char *captureDir;
+static int captureEvery = 1;
+static thread_local Pixmap capturePixmap;
+static thread_local FILE *captureLog;
+
+static Picture
+root_picture(Display *dpy) {
+    XRenderPictureAttributes pa;
+
+    pa.subwindow_mode = IncludeInferiors;
+    if (!captureDir)
+        return XRenderCreatePicture(dpy, root,
+                                    XRenderFindVisualFormat(dpy, DefaultVisual (dpy, scr)),
+                                    CPSubwindowMode, &pa);
+    if (capturePixmap)
+        XFreePixmap(dpy, capturePixmap);
+    capturePixmap = XCreatePixmap(dpy, root, root_width, root_height, DefaultDepth (dpy, scr));
+    return XRenderCreatePicture(dpy, capturePixmap,
+                                XRenderFindVisualFormat(dpy, DefaultVisual (dpy, scr)),
+                                0, nullptr);
+}
+
+static Bool
+open_capture() {
+    char path[4096];
+
+    if (screenCount > 1)
+        snprintf(path, sizeof(path), "%s/frames-%d.log", captureDir, scr);
+    else
+        snprintf(path, sizeof(path), "%s/frames.log", captureDir);
+    captureLog = fopen(path, "w");
+    if (!captureLog) {
+        perror(path);
+        return False;
+    }
+    fprintf(captureLog, "# frame seconds pixels rects x y width height file\n");
+    return True;
+}
+
+static int
+mask_shift(unsigned long mask) {
+    int shift = 0;
+
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+static Bool
+write_ppm(const char *path, XImage *image) {
+    static thread_local std::vector<unsigned char> row;
+    unsigned long masks[3] = {image->red_mask, image->green_mask, image->blue_mask};
+    int shifts[3];
+    unsigned long maxes[3];
+    FILE *f = fopen(path, "wb");
+
+    if (!f) {
+        perror(path);
+        return False;
+    }
+    for (int c = 0; c < 3; c++) {
+        shifts[c] = mask_shift(masks[c]);
+        maxes[c] = masks[c] >> shifts[c];
+    }
+    fprintf(f, "P6\n%d %d\n255\n", image->width, image->height);
+    row.resize(image->width * 3);
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            unsigned long pixel = XGetPixel(image, x, y);
+
+            for (int c = 0; c < 3; c++)
+                row[x * 3 + c] = maxes[c] ? ((pixel & masks[c]) >> shifts[c]) * 255 / maxes[c] : 0;
+        }
+        fwrite(row.data(), 1, row.size(), f);
+    }
+    return fclose(f) == 0;
+}
+
+static void
+capture_frame(Display *dpy, double seconds, long area) {
+    char path[4096];
+    int x0 = root_width, y0 = root_height, x1 = 0, y1 = 0;
+
+    for (const XRectangle &r : frameRects) {
+        x0 = r.x < x0 ? r.x : x0;
+        y0 = r.y < y0 ? r.y : y0;
+        x1 = r.x + r.width > x1 ? r.x + r.width : x1;
+        y1 = r.y + r.height > y1 ? r.y + r.height : y1;
+    }
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    path[0] = '\0';
+    if (stats.frames % captureEvery == 0) {
+        XImage *image = XGetImage(dpy, capturePixmap, x0, y0, x1 - x0, y1 - y0, AllPlanes, ZPixmap);
+
+        if (image) {
+            if (screenCount > 1)
+                snprintf(path, sizeof(path), "%s/%d-%06lu.ppm", captureDir, scr, stats.frames);
+            else
+                snprintf(path, sizeof(path), "%s/%06lu.ppm", captureDir, stats.frames);
+            if (!write_ppm(path, image))
+                path[0] = '\0';
+            XDestroyImage(image);
+        }
+    }
+    fprintf(captureLog, "%lu %.6f %ld %zu %d %d %d %d %s\n", stats.frames, seconds, area,
+            frameRects.size(), x0, y0, x1 - x0, y1 - y0, path[0] ? path : "-");
+    fflush(captureLog);
+}
+
+static void
+resize_damage_tiles() {
+    tilesX = (root_width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    tilesY = (root_height + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    damageTiles.assign(tilesX * tilesY, 0);
+    backdropTiles.assign(tilesX * tilesY, 1);
+    heat.assign(heatmap ? tilesX * tilesY : 0, 0);
+    damagePending = False;
+}
+
+/* sets the tiles touching the rectangle, returns False if there are none */
+static Bool
+mark_tiles(std::vector<unsigned char> &tiles, int x, int y, int width, int height) {
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + width > root_width ? root_width : x + width;
+    int y1 = y + height > root_height ? root_height : y + height;
+
+    if (x0 >= x1 || y0 >= y1)
+        return False;
+    int tx0 = x0 / DAMAGE_TILE;
+    int tx1 = (x1 - 1) / DAMAGE_TILE;
+    for (int ty = y0 / DAMAGE_TILE; ty <= (y1 - 1) / DAMAGE_TILE; ty++)
+        memset(&tiles[ty * tilesX + tx0], 1, tx1 - tx0 + 1);
+    return True;
+}
+
+static void
+add_damage(int x, int y, int width, int height) {
+    if (mark_tiles(damageTiles, x, y, width, height)) {
+        damagePending = True;
+        if (backdrop && !layerDamage)
+            mark_tiles(backdropTiles, x, y, width, height);
     }
-#endif
-    XFixesSetPictureClipRegion(dpy, rootPicture, 0, 0, region);
-#if MONITOR_REPAINT
-    XRenderComposite (dpy, PictOpSrc, blackPicture, None, rootPicture,
-              0, 0, 0, 0, 0, 0, root_width, root_height);
-#endif
-#if DEBUG_REPAINT
-    printf ("paint:");
-#endif
+}
+
+static void
+add_damage(const XRectangle &r) {
+    add_damage(r.x, r.y, r.width, r.height);
+}
+
+/* grows d to also cover r */
+static void
+extend_rect(XRectangle &d, const XRectangle &r) {
+    if (!r.width || !r.height)
+        return;
+    if (!d.width || !d.height) {
+        d = r;
+        return;
+    }
+    int x1 = d.x + d.width > r.x + r.width ? d.x + d.width : r.x + r.width;
+    int y1 = d.y + d.height > r.y + r.height ? d.y + d.height : r.y + r.height;
+    d.x = d.x < r.x ? d.x : r.x;
+    d.y = d.y < r.y ? d.y : r.y;
+    d.width = static_cast<unsigned short>(x1 - d.x);
+    d.height = static_cast<unsigned short>(y1 - d.y);
+}
+
+/* In hybrid mode the server keeps everything else on screen, so only
+   damage under the windows redirected here is painted. */
+static void
+clip_hybrid_damage(Display *dpy) {
+    static thread_local std::vector<unsigned char> manual;
 
-    std::list<win *> transparent;
+    manual.assign(damageTiles.size(), 0);
     for (auto w = win_list.begin(); w != win_list.end(); w++) {
-#if CAN_DO_USABLE
-        if (!w->usable)
-        continue;
-#endif
-        /* never painted, ignores it */
-        if (!w->damaged)
-            continue;
-        /* if invisible, ignores it */
-        if (w->a.x + w->a.width < 1 || w->a.y + w->a.height < 1
-            || w->a.x >= root_width || w->a.y >= root_height)
+        if (!w->redirected || w->a.map_state != IsViewable)
             continue;
-        if (!w->picture) {
-            XRenderPictureAttributes pa;
-            XRenderPictFormat *format;
-            Drawable draw = w->id;
+        const XRectangle r = w->extents ? w->extentsRect : win_extents(dpy, w);
+        mark_tiles(manual, r.x, r.y, r.width, r.height);
+    }
+    damagePending = False;
+    for (size_t t = 0; t < damageTiles.size(); t++) {
+        damageTiles[t] &= manual[t];
+        if (damageTiles[t])
+            damagePending = True;
+    }
+}
 
-#if HAS_NAME_WINDOW_PIXMAP
-            if (hasNamePixmap && !w->pixmap)
-                w->pixmap = XCompositeNameWindowPixmap(dpy, w->id);
-            if (w->pixmap)
-                draw = w->pixmap;
-#endif
-            format = XRenderFindVisualFormat(dpy, w->a.visual);
-            pa.subwindow_mode = IncludeInferiors;
-            w->picture = XRenderCreatePicture(dpy, draw,
-                                             format,
-                                             CPSubwindowMode,
-                                             &pa);
+/* Repaint heatmap: every frame that paints a tile heats it by HEAT_STEP,
+   and HEAT_INTERVAL times a second all tiles cool by HEAT_DECAY.  Warm
+   tiles are tinted from blue to red over the finished frame, and every
+   window gets a bar along its top edge as long as HEAT_BAR pixels times
+   its repairs in the last second.  Overlays are drawn over the whole
+   stack, so bars of hidden windows show through.  Nothing here runs
+   until SIGUSR2 turns it on.
+ */
+#define HEAT_STEP    64
+#define HEAT_DECAY    16
+#define HEAT_INTERVAL    (1.0 / 30)
+#define HEAT_LEVELS    8
+#define HEAT_BAR    4
+
+static thread_local Bool heatWarm;
+static thread_local timespec heatUpdated;
+static thread_local timespec heatSampled;
+
+static void
+toggle_heatmap() {
+    heatmap = !heatmap;
+    heat.assign(heatmap ? tilesX * tilesY : 0, 0);
+    for (auto &w: win_list) {
+        w.repaints = 0;
+        w.repaintRate = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &heatUpdated);
+    heatSampled = heatUpdated;
+    heatWarm = False;
+    /* paint the overlay in, or out */
+    add_damage(0, 0, root_width, root_height);
+}
+
+static XRectangle
+heat_bar(const win &w) {
+    int width = w.a.width + w.a.border_width * 2;
+    int length = w.repaintRate * HEAT_BAR;
+
+    return {
+        static_cast<short>(w.a.x),
+        static_cast<short>(w.a.y),
+        static_cast<unsigned short>(length < width ? length : width),
+        static_cast<unsigned short>(HEAT_BAR)
+    };
+}
+
+/* Called before the damage is turned into a frame; adds the damage to
+   the heat and, when due, cools everything and repaints what is warm. */
+static void
+update_heat() {
+    if (damagePending) {
+        for (size_t t = 0; t < heat.size(); t++)
+            if (damageTiles[t])
+                heat[t] = heat[t] > 255 - HEAT_STEP ? 255 : heat[t] + HEAT_STEP;
+        heatWarm = True;
+    }
+    if (!heatWarm || elapsed(heatUpdated) < HEAT_INTERVAL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &heatUpdated);
+
+    heatWarm = False;
+    for (size_t t = 0; t < heat.size(); t++) {
+        if (!heat[t])
+            continue;
+        /* repainting the tile replaces its tint, even the last time */
+        heat[t] = heat[t] > HEAT_DECAY ? heat[t] - HEAT_DECAY : 0;
+        damageTiles[t] = 1;
+        damagePending = True;
+        if (heat[t])
+            heatWarm = True;
+    }
+    Bool sample = elapsed(heatSampled) >= 1;
+    if (sample)
+        heatSampled = heatUpdated;
+    for (auto &w: win_list) {
+        if (sample && (w.repaints || w.repaintRate)) {
+            add_damage(heat_bar(w));
+            w.repaintRate = w.repaints;
+            w.repaints = 0;
+            add_damage(heat_bar(w));
         }
-#if DEBUG_REPAINT
-        printf (" 0x%x", w->id);
-#endif
-        if (clipChanged) {
-            if (w->borderSize) {
-                set_ignore(dpy, NextRequest (dpy));
-                XFixesDestroyRegion(dpy, w->borderSize);
-                w->borderSize = None;
+        if (w.repaints || w.repaintRate)
+            heatWarm = True;
+    }
+}
+
+/* milliseconds until update_heat cools the heatmap again, or -1 */
+static int
+heat_timeout() {
+    if (!heatmap || !heatWarm)
+        return -1;
+    double since = elapsed(heatUpdated);
+    return since < HEAT_INTERVAL ? (int) ((HEAT_INTERVAL - since) * 1000) + 1 : 0;
+}
+
+static void
+paint_heatmap(Display *dpy) {
+    static thread_local std::vector<XRectangle> rects;
+
+    /* painting has cut the opaque windows out of the damage region */
+    XRenderSetPictureClipRectangles(dpy, rootBuffer, 0, 0,
+                                    frameRects.data(), frameRects.size());
+    forget_clip_picture(rootBuffer);
+    for (int level = 1; level <= HEAT_LEVELS; level++) {
+        rects.clear();
+        for (int ty = 0; ty < tilesY; ty++)
+            for (int tx = 0; tx < tilesX; tx++) {
+                int h = heat[ty * tilesX + tx];
+
+                if (!h || (h * HEAT_LEVELS + 255) / 256 != level)
+                    continue;
+                rects.push_back({
+                    static_cast<short>(tx * DAMAGE_TILE),
+                    static_cast<short>(ty * DAMAGE_TILE),
+                    DAMAGE_TILE, DAMAGE_TILE
+                });
+            }
+        if (rects.empty())
+            continue;
+        /* premultiplied, from faint blue to strong red */
+        double alpha = 0.1 + 0.4 * level / HEAT_LEVELS;
+        XRenderColor color;
+        color.alpha = (unsigned short) (alpha * 0xffff);
+        color.red = (unsigned short) (alpha * level / HEAT_LEVELS * 0xffff);
+        color.green = 0;
+        color.blue = (unsigned short) (alpha * (HEAT_LEVELS - level) / HEAT_LEVELS * 0xffff);
+        XRenderFillRectangles(dpy, PictOpOver, rootBuffer, &color, rects.data(), rects.size());
+    }
+
+    rects.clear();
+    for (auto &w: win_list)
+        if (w.a.map_state == IsViewable && w.repaintRate)
+            rects.push_back(heat_bar(w));
+    if (!rects.empty()) {
+        XRenderColor color = {0xe000, 0xe000, 0, 0xe000};
+        XRenderFillRectangles(dpy, PictOpOver, rootBuffer, &color, rects.data(), rects.size());
+    }
+}
+
+/* pixels wasted by covering a and b with their bounding box */
+static long
+merge_cost(const XRectangle &a, const XRectangle &b) {
+    int x0 = a.x < b.x ? a.x : b.x;
+    int y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+
+    return (long) (x1 - x0) * (y1 - y0) - (long) a.width * a.height - (long) b.width * b.height;
+}
+
+/* Turn the marked tiles into a region and clear them.  Runs of tiles
+   along a row become rectangles, which grow downwards while the next row
+   repeats the same run.  Past MAX_DAMAGE_RECTS, neighbouring rectangles
+   are merged into their bounding box, cheapest first.
+ */
+static XserverRegion
+damage_region(Display *dpy, long *area) {
+    std::vector<XRectangle> &rects = frameRects;
+    /* rectangles reaching down to the row being scanned, and the next row */
+    static thread_local std::vector<size_t> open, next;
+
+    rects.clear();
+    open.clear();
+    *area = 0;
+    for (int ty = 0; ty < tilesY; ty++) {
+        int y = ty * DAMAGE_TILE;
+        int height = y + DAMAGE_TILE > root_height ? root_height - y : DAMAGE_TILE;
+
+        next.clear();
+        for (int tx = 0; tx < tilesX;) {
+            if (!damageTiles[ty * tilesX + tx]) {
+                tx++;
+                continue;
             }
-            if (w->extents) {
-                XFixesDestroyRegion(dpy, w->extents);
-                w->extents = None;
+            int start = tx;
+            while (tx < tilesX && damageTiles[ty * tilesX + tx])
+                tx++;
+            short x = static_cast<short>(start * DAMAGE_TILE);
+            unsigned short width = static_cast<unsigned short>(
+                    (tx * DAMAGE_TILE > root_width ? root_width : tx * DAMAGE_TILE) - x);
+            *area += (long) width * height;
+
+            size_t i = rects.size();
+            for (size_t o : open) {
+                if (rects[o].x == x && rects[o].width == width) {
+                    i = o;
+                    break;
+                }
             }
-            if (w->borderClip) {
-                XFixesDestroyRegion(dpy, w->borderClip);
-                w->borderClip = None;
+            if (i < rects.size())
+                rects[i].height += height;
+            else
+                rects.push_back(XRectangle{x, static_cast<short>(y), width, static_cast<unsigned short>(height)});
+            next.push_back(i);
+        }
+        open.swap(next);
+    }
+    damageTiles.assign(damageTiles.size(), 0);
+    damagePending = False;
+
+    while (rects.size() > MAX_DAMAGE_RECTS) {
+        size_t best = 0;
+        long bestCost = merge_cost(rects[0], rects[1]);
+        for (size_t i = 1; i + 1 < rects.size(); i++) {
+            long cost = merge_cost(rects[i], rects[i + 1]);
+            if (cost < bestCost) {
+                best = i;
+                bestCost = cost;
             }
         }
-        if (!w->borderSize)
-            w->borderSize = border_size(dpy, w);
-        if (!w->extents)
-            w->extents = win_extents(dpy, w);
+        XRectangle &a = rects[best];
+        const XRectangle &b = rects[best + 1];
+        int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+        int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+        a.x = a.x < b.x ? a.x : b.x;
+        a.y = a.y < b.y ? a.y : b.y;
+        a.width = static_cast<unsigned short>(x1 - a.x);
+        a.height = static_cast<unsigned short>(y1 - a.y);
+        rects.erase(rects.begin() + best + 1);
+    }
+    stats.damageRects += rects.size();
+    return XFixesCreateRegion(dpy, rects.data(), rects.size());
+}
 
-        if (w->mode == WINDOW_SOLID) {
-            int x, y, wid, hei;
+/* area is the damaged rectangle reported by the event, in window coordinates */
+static void
+repair_win(Display *dpy, win_it w, const XRectangle &area) {
+    /* the rectangles come with the events, the server copy is only
+       emptied so that the next change gets reported again */
+    set_ignore(dpy, NextRequest (dpy));
+    XDamageSubtract(dpy, w->damage, None, None);
 #if HAS_NAME_WINDOW_PIXMAP
-            x = w->a.x;
-            y = w->a.y;
-            wid = w->a.width + w->a.border_width * 2;
-            hei = w->a.height + w->a.border_width * 2;
-#else
-            x = w->a.x + w->a.border_width;
-        y = w->a.y + w->a.border_width;
-        wid = w->a.width;
-        hei = w->a.height;
-#endif
-            XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, region);
-            set_ignore(dpy, NextRequest (dpy));
-            XFixesSubtractRegion(dpy, region, region, w->borderSize);
-            set_ignore(dpy, NextRequest (dpy));
-            XRenderComposite(dpy, PictOpSrc, w->picture, None, rootBuffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        }
-        if (!w->borderClip) {
-            w->borderClip = XFixesCreateRegion(dpy, nullptr, 0);
-            XFixesCopyRegion(dpy, w->borderClip, region);
-            XFixesIntersectRegion(dpy, w->borderClip, w->borderClip, w->borderSize);
-        }
-        transparent.push_front(&*w);
+    /* the client has drawn into the pixmap of the new mapping */
+    if (w->stale) {
+        release_pixmap(dpy, w);
+        w->damaged = 0;
     }
-#if DEBUG_REPAINT
-    printf ("\n");
-    fflush (stdout);
 #endif
-    XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, region);
-    paint_root(dpy);
-    for (win *w : transparent) {
-        XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, w->borderClip);
-        switch (compMode) {
-            case CompSimple:
-                break;
+    XRectangle r;
+    if (!w->damaged) {
+        r = win_extents(dpy, w);
+        thumb_damage(w, 0, 0, w->a.width + w->a.border_width * 2,
+                     w->a.height + w->a.border_width * 2);
+    } else {
+        r = {static_cast<short>(w->a.x + w->a.border_width + area.x),
+             static_cast<short>(w->a.y + w->a.border_width + area.y),
+             area.width, area.height};
+        thumb_damage(w, w->a.border_width + area.x, w->a.border_width + area.y,
+                     area.width, area.height);
+    }
+    if (degraded && w->background)
+        extend_rect(w->deferred, r);
+    else {
+        layerDamage = backdrop && w->aboveLayer;
+        add_damage(r);
+        layerDamage = False;
+    }
+    if (saverOn && w->id == saverWindow)
+        saverDamaged = True;
+    if (w->damageFrame != stats.frames) {
+        w->damageStreak = w->damageFrame + 1 == stats.frames ? w->damageStreak + 1 : 1;
+        w->damageFrame = stats.frames;
+    }
+    w->damaged = 1;
+    if (heatmap)
+        w->repaints++;
+}
+
+/* Apply a new opacity.  determine_mode damages the extents; the shadow
+   is only rebuilt when it crosses into another opacity level.
+ */
+static void
+set_opacity(Display *dpy, win_it w, unsigned int opacity) {
+    w->opacity = opacity;
+    determine_mode(dpy, w);
+    if (w->shadow && shadow_level(&*w) != w->shadow_level) {
+        free_shadow(dpy, w);
+        if (w->extents) {
+            XFixesDestroyRegion(dpy, w->extents);
+            update_extents(dpy, w);
+            add_damage(w->extentsRect);
         }
-        if (w->opacity != OPAQUE && !w->alphaPict)
-            w->alphaPict = solid_picture(dpy, False,
-                                         (double) w->opacity / OPAQUE, 0, 0, 0);
-        if (w->mode == WINDOW_TRANS) {
-            int x, y, wid, hei;
+    }
+}
+
+struct fade {
+    win_it w;
+    double cur;
+    double finish;
+    double step;
+    void (*callback)(Display *dpy, win_it w, Bool gone);
+    Bool gone;
+};
+
+static thread_local std::list<fade> fades;
+
+/* fires every fade_delta while any fade runs, disarmed otherwise */
+static thread_local int fadeTimer = -1;
+static thread_local Bool fadeTimerArmed = False;
+
+static void
+arm_fade_timer(Bool on) {
+    itimerspec its{};
+
+    if (fadeTimer < 0 || fadeTimerArmed == on)
+        return;
+    if (on) {
+        its.it_value.tv_sec = fade_delta / 1000;
+        its.it_value.tv_nsec = (fade_delta % 1000) * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    if (timerfd_settime(fadeTimer, 0, &its, nullptr) == 0)
+        fadeTimerArmed = on;
+}
+
+static std::list<fade>::iterator
+find_fade(win_it w) {
+    for (auto f = fades.begin(); f != fades.end(); f++) {
+        if (f->w == w)
+            return f;
+    }
+    return fades.end();
+}
+
+static Bool
+win_fading(win_it w) {
+    return find_fade(w) != fades.end();
+}
+
+static void
+dequeue_fade(Display *dpy, std::list<fade>::iterator f) {
+    auto callback = f->callback;
+    win_it w = f->w;
+    Bool gone = f->gone;
+
+    /* off the list first, the callback may destroy the window */
+    fades.erase(f);
+    if (fades.empty())
+        arm_fade_timer(False);
+    if (callback)
+        (*callback)(dpy, w, gone);
+}
+
 #if HAS_NAME_WINDOW_PIXMAP
-            x = w->a.x;
-            y = w->a.y;
-            wid = w->a.width + w->a.border_width * 2;
-            hei = w->a.height + w->a.border_width * 2;
-#else
-            x = w->a.x + w->a.border_width;
-        y = w->a.y + w->a.border_width;
-        wid = w->a.width;
-        hei = w->a.height;
+static void
+destroy_callback(Display *dpy, win_it w, Bool gone);
 #endif
-            set_ignore(dpy, NextRequest (dpy));
-            XRenderComposite(dpy, PictOpOver, w->picture, w->alphaPict, rootBuffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        } else if (w->mode == WINDOW_ARGB) {
-            int x, y, wid, hei;
+
+/* called while destroying w: finish a pending unmap, but a pending
+   destroy is the one already under way */
+static void
+cleanup_fade(Display *dpy, win_it w) {
+    auto f = find_fade(w);
+    if (f == fades.end())
+        return;
 #if HAS_NAME_WINDOW_PIXMAP
-            x = w->a.x;
-            y = w->a.y;
-            wid = w->a.width + w->a.border_width * 2;
-            hei = w->a.height + w->a.border_width * 2;
-#else
-            x = w->a.x + w->a.border_width;
-        y = w->a.y + w->a.border_width;
-        wid = w->a.width;
-        hei = w->a.height;
+    if (f->callback == destroy_callback)
+        f->callback = nullptr;
 #endif
-            set_ignore(dpy, NextRequest (dpy));
-            XRenderComposite(dpy, PictOpOver, w->picture, w->alphaPict, rootBuffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        }
-        XFixesDestroyRegion(dpy, w->borderClip);
-        w->borderClip = None;
-    }
-    XFixesDestroyRegion(dpy, region);
-    if (rootBuffer != rootPicture) {
-        XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, None);
-        XRenderComposite(dpy, PictOpSrc, rootBuffer, None, rootPicture,
-                         0, 0, 0, 0, 0, 0, root_width, root_height);
-    }
+    dequeue_fade(dpy, f);
 }
 
 static void
-add_damage(Display *dpy, XserverRegion damage) {
-    if (allDamage) {
-        XFixesUnionRegion(dpy, allDamage, allDamage, damage);
-        XFixesDestroyRegion(dpy, damage);
-    } else
-        allDamage = damage;
+set_fade(Display *dpy, win_it w, double start, double finish, double step,
+         void (*callback)(Display *dpy, win_it w, Bool gone),
+         Bool gone, Bool exec_callback, Bool override) {
+    auto f = find_fade(w);
+
+    if (f == fades.end()) {
+        arm_fade_timer(True);
+        fades.push_front(fade{w, start, 0, 0, nullptr, False});
+        f = fades.begin();
+    } else if (!override) {
+        return;
+    } else if (exec_callback && f->callback) {
+        (*f->callback)(dpy, f->w, f->gone);
+    }
+
+    if (finish < 0)
+        finish = 0;
+    if (finish > 1)
+        finish = 1;
+    f->finish = finish;
+    if (f->cur < finish)
+        f->step = step;
+    else if (f->cur > finish)
+        f->step = -step;
+    f->callback = callback;
+    f->gone = gone;
+    set_opacity(dpy, w, (unsigned int) (f->cur * OPAQUE));
 }
 
+/* Step every fade by the number of timer expirations since the last run,
+   so a late wakeup catches up instead of slowing the fade down.
+ */
 static void
-repair_win(Display *dpy, win_it w) {
-    XserverRegion parts;
+run_fades(Display *dpy) {
+    uint64_t expirations = 0;
 
-    if (!w->damaged) {
-        parts = win_extents(dpy, w);
-        set_ignore(dpy, NextRequest (dpy));
-        XDamageSubtract(dpy, w->damage, None, None);
-    } else {
-        parts = XFixesCreateRegion(dpy, nullptr, 0);
-        set_ignore(dpy, NextRequest (dpy));
-        XDamageSubtract(dpy, w->damage, None, parts);
-        XFixesTranslateRegion(dpy, parts,
-                              w->a.x + w->a.border_width,
-                              w->a.y + w->a.border_width);
+    if (read(fadeTimer, &expirations, sizeof(expirations)) != sizeof(expirations) || !expirations)
+        return;
+
+    for (auto next = fades.begin(); next != fades.end();) {
+        auto f = next++;
+        win_it w = f->w;
+        Bool need_dequeue = False;
+
+        f->cur += f->step * expirations;
+        if (f->cur >= 1)
+            f->cur = 1;
+        else if (f->cur < 0)
+            f->cur = 0;
+        if (f->step > 0 ? f->cur >= f->finish : f->cur <= f->finish) {
+            f->cur = f->finish;
+            need_dequeue = True;
+        }
+        set_opacity(dpy, w, (unsigned int) (f->cur * OPAQUE));
+        /* Must do this last as it might destroy f->w in callbacks */
+        if (need_dequeue)
+            dequeue_fade(dpy, f);
     }
-    add_damage(dpy, parts);
-    w->damaged = 1;
 }
 
-static unsigned int
-get_opacity_prop(Display *dpy, win_it w, unsigned int def);
+static void
+queue_opacity(Window id);
 
 static void
-map_win(Display *dpy, Window id) {
+map_win(Display *dpy, Window id, Bool fade) {
     auto w = find_win(id);
 
     if (w == win_list.end())
         return;
 
     w->a.map_state = IsViewable;
+    /* fetched here rather than by the first paint, which must not allocate */
+    if (!w->shapeKnown)
+        fetch_shape(dpy, w);
 
     /* This needs to be here or else we lose transparency messages */
-    XSelectInput(dpy, id, PropertyChangeMask);
+    uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    discard_error(xcb_change_window_attributes_checked(xconn, id, XCB_CW_EVENT_MASK, &mask));
 
     /* This needs to be here since we don't get PropertyNotify when unmapped */
-    w->opacity = get_opacity_prop(dpy, w, OPAQUE);
-    determine_mode(dpy, w);
+    queue_opacity(id);
+    w->fadeIn = fade && fadeWindows;
 
 #if CAN_DO_USABLE
     w->damage_bounds.x = w->damage_bounds.y = 0;
     w->damage_bounds.width = w->damage_bounds.height = 0;
+#endif
+#if HAS_NAME_WINDOW_PIXMAP
+    /* show the old contents until the client has drawn the new ones */
+    if (w->pixmap) {
+        w->stale = True;
+        w->damaged = 1;
+        add_damage(win_extents(dpy, w));
+        stats.pixmapsReused++;
+        return;
+    }
 #endif
     w->damaged = 0;
 }
@@ -533,26 +2912,22 @@ finish_unmap_win(Display *dpy, win_it w) {
     w->usable = False;
 #endif
     if (w->extents != None) {
-        add_damage(dpy, w->extents);    /* destroys region */
+        add_damage(w->extentsRect);
+        XFixesDestroyRegion(dpy, w->extents);
         w->extents = None;
     }
 
 #if HAS_NAME_WINDOW_PIXMAP
-    if (w->pixmap) {
-        XFreePixmap(dpy, w->pixmap);
-        w->pixmap = None;
-    }
+    /* a named pixmap keeps the last contents after the unmap */
+    if (w->pixmap && pixmapBudget > 0)
+        w->lastUsed = stats.frames;
+    else
 #endif
-
-    if (w->picture) {
-        set_ignore(dpy, NextRequest (dpy));
-        XRenderFreePicture(dpy, w->picture);
-        w->picture = None;
-    }
+        release_pixmap(dpy, w);
 
     /* don't care about properties anymore */
-    set_ignore(dpy, NextRequest (dpy));
-    XSelectInput(dpy, w->id, 0);
+    uint32_t mask = 0;
+    discard_error(xcb_change_window_attributes_checked(xconn, w->id, XCB_CW_EVENT_MASK, &mask));
 
     if (w->borderSize) {
         set_ignore(dpy, NextRequest (dpy));
@@ -563,8 +2938,6 @@ finish_unmap_win(Display *dpy, win_it w) {
         XFixesDestroyRegion(dpy, w->borderClip);
         w->borderClip = None;
     }
-
-    clipChanged = True;
 }
 
 #if HAS_NAME_WINDOW_PIXMAP
@@ -582,7 +2955,28 @@ unmap_win(Display *dpy, Window id, Bool fade) {
     if (w == win_list.end())
         return;
     w->a.map_state = IsUnmapped;
-    finish_unmap_win(dpy, w);
+#if HAS_NAME_WINDOW_PIXMAP
+    if (w->pixmap && fade && fadeWindows)
+        set_fade(dpy, w, w->opacity * 1.0 / OPAQUE, 0.0, fade_out_step,
+                 unmap_callback, False, False, True);
+    else
+#endif
+        finish_unmap_win(dpy, w);
+}
+
+/* Pull the opacity out of a property reply and free it
+   not found: default
+   otherwise the value
+ */
+static unsigned int
+opacity_from_reply(xcb_get_property_reply_t *reply, unsigned int def) {
+    unsigned int opacity = def;
+
+    if (reply && reply->type == XA_CARDINAL && reply->format == 32 &&
+        xcb_get_property_value_length(reply) == 4)
+        opacity = *(uint32_t *) xcb_get_property_value(reply);
+    free(reply);
+    return opacity;
 }
 
 /* Get the opacity prop from window
@@ -591,58 +2985,204 @@ unmap_win(Display *dpy, Window id, Bool fade) {
  */
 static unsigned int
 get_opacity_prop(Display *dpy, win_it w, unsigned int def) {
-    Atom actual;
-    int format;
-    unsigned long n, left;
+    xcb_get_property_cookie_t cookie = xcb_get_property(xconn, 0, w->id, opacityAtom, XA_CARDINAL, 0, 1);
+
+    return opacity_from_reply(xcb_get_property_reply(xconn, cookie, nullptr), def);
+}
+
+static void
+queue_opacity(Window id) {
+    for (Window pending : opacityPending) {
+        if (pending == id)
+            return;
+    }
+    opacityPending.push_back(id);
+}
+
+/* Fetch the opacity of every queued window with one round trip and
+   re-evaluate their modes.  Windows that vanished in the meantime just
+   produce an error reply, which is dropped with the cookie.
+ */
+static void
+update_opacity(Display *dpy) {
+    static thread_local std::vector<xcb_get_property_cookie_t> cookies;
+
+    if (opacityPending.empty())
+        return;
+    cookies.clear();
+    for (Window id : opacityPending)
+        cookies.push_back(xcb_get_property(xconn, 0, id, opacityAtom, XA_CARDINAL, 0, 1));
+    for (size_t i = 0; i < opacityPending.size(); i++) {
+        unsigned int opacity = opacity_from_reply(xcb_get_property_reply(xconn, cookies[i], nullptr), OPAQUE);
+        win_it w = find_win(opacityPending[i]);
+
+        if (w == win_list.end())
+            continue;
+        if (w->fadeIn) {
+            w->fadeIn = False;
+            set_fade(dpy, w, 0, opacity * 1.0 / OPAQUE, fade_in_step,
+                     nullptr, False, True, True);
+        } else if (fadeTrans && w->a.map_state == IsViewable) {
+            set_fade(dpy, w, w->opacity * 1.0 / OPAQUE, opacity * 1.0 / OPAQUE, fade_out_step,
+                     nullptr, False, True, False);
+        } else {
+            set_opacity(dpy, w, opacity);
+        }
+    }
+    opacityPending.clear();
+}
+
+/* Get the opacity property from the window in a percent format
+   not found: default
+   otherwise: the value
+*/
+static double
+get_opacity_percent(Display *dpy, win_it w, double def) {
+    unsigned int opacity = get_opacity_prop(dpy, w, (unsigned int) (OPAQUE * def));
+
+    return opacity * 1.0 / OPAQUE;
+}
+
+/* determine mode for window all in one place.
+   Future might check for menu flag and other cool things
+*/
+
+static xcb_get_property_cookie_t
+get_wintype_prop(Window w) {
+    return xcb_get_property(xconn, 0, w, winTypeAtom, XA_ATOM, 0, 1);
+}
+
+static Atom
+wintype_from_reply(xcb_get_property_reply_t *reply) {
+    Atom a = winNormalAtom;
+
+    if (reply && reply->type == XA_ATOM && reply->format == 32 &&
+        xcb_get_property_value_length(reply) >= 4)
+        a = *(uint32_t *) xcb_get_property_value(reply);
+    free(reply);
+    return a;
+}
+
+/* Adaptive quality (-Q): frame times are averaged, and once the
+   average exceeds frameBudget translucent windows are painted opaque,
+   ARGB windows are painted opaque while dragged (paint_mode), and damage
+   to windows below the topmost normal window is collected and painted
+   only BACKGROUND_INTERVAL times a second.  Full quality returns once
+   the average drops under half the budget or painting goes idle.
+ */
+#define FRAME_AVERAGE_WEIGHT    0.2
+#define BACKGROUND_INTERVAL    0.1
+#define RECOVER_IDLE    0.5
+
+static thread_local timespec lastFrame;
+static thread_local timespec backgroundFlushed;
 
-    unsigned char *data;
-    int result = XGetWindowProperty(dpy, w->id, opacityAtom, 0L, 1L, False,
-                                    XA_CARDINAL, &actual, &format,
-                                    &n, &left, &data);
-    if (result == Success && data != nullptr) {
-        unsigned int i;
-        i = *data;
-//        memcpy(&i, data, sizeof(unsigned int));
-        XFree(data);
-        return i;
+static void
+flush_deferred(win_it w) {
+    if (w->deferred.width && w->deferred.height)
+        add_damage(w->deferred);
+    w->deferred = {0, 0, 0, 0};
+}
+
+static void
+set_degraded(Display *dpy, Bool on) {
+    degraded = on;
+    if (on) {
+        stats.degrades++;
+        clock_gettime(CLOCK_MONOTONIC, &degradedAt);
+        backgroundFlushed = degradedAt;
+    } else {
+        stats.restores++;
+        stats.degradedSeconds += elapsed(degradedAt);
+    }
+    /* repaint everything whose look changes */
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        if (w->mode != WINDOW_SOLID && w->a.map_state == IsViewable)
+            add_damage(w->extents ? w->extentsRect : win_extents(dpy, w));
+        w->blendSkipped = False;
+        w->background = False;
+        flush_deferred(w);
     }
-    return def;
 }
 
-/* Get the opacity property from the window in a percent format
-   not found: default
-   otherwise: the value
-*/
-static double
-get_opacity_percent(Display *dpy, win_it w, double def) {
-    unsigned int opacity = get_opacity_prop(dpy, w, (unsigned int) (OPAQUE * def));
+/* after every frame */
+static void
+frame_quality(Display *dpy, double seconds) {
+    clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+    frameAverage += (seconds - frameAverage) * FRAME_AVERAGE_WEIGHT;
+    if (!degraded && frameAverage > frameBudget)
+        set_degraded(dpy, True);
+    else if (degraded && frameAverage < frameBudget / 2)
+        set_degraded(dpy, False);
+}
 
-    return opacity * 1.0 / OPAQUE;
+/* Called before the damage is turned into a frame while degraded. */
+static void
+update_quality(Display *dpy) {
+    if (elapsed(lastFrame) >= RECOVER_IDLE) {
+        frameAverage = 0;
+        set_degraded(dpy, False);
+        return;
+    }
+    Bool flush = elapsed(backgroundFlushed) >= BACKGROUND_INTERVAL;
+    if (flush)
+        clock_gettime(CLOCK_MONOTONIC, &backgroundFlushed);
+
+    Bool below = False;
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        w->background = below;
+        if (w->a.map_state == IsViewable && w->windowType == winNormalAtom)
+            below = True;
+        if (flush || !w->background)
+            flush_deferred(w);
+        /* the drag is over, blend it again */
+        if (w->blendSkipped && elapsed(w->movedAt) >= MOVE_SETTLE) {
+            w->blendSkipped = False;
+            add_damage(w->extents ? w->extentsRect : win_extents(dpy, w));
+        }
+    }
 }
 
-/* determine mode for window all in one place.
-   Future might check for menu flag and other cool things
-*/
+/* milliseconds until update_quality is due again, or -1 */
+static int
+quality_timeout() {
+    if (!degraded)
+        return -1;
+    double since = elapsed(backgroundFlushed);
+    return since < BACKGROUND_INTERVAL ? (int) ((BACKGROUND_INTERVAL - since) * 1000) + 1 : 0;
+}
 
-static Atom
-get_wintype_prop(Display *dpy, Window w) {
-    Atom actual;
-    int format;
-    unsigned long n, left;
+/* the earlier of two poll timeouts, -1 meaning none */
+static int
+sooner(int a, int b) {
+    return a < 0 || (b >= 0 && b < a) ? b : a;
+}
 
-    unsigned char *data;
-    int result = XGetWindowProperty(dpy, w, winTypeAtom, 0L, 1L, False,
-                                    XA_ATOM, &actual, &format,
-                                    &n, &left, &data);
+/* Hybrid mode: move the window between the server's automatic
+   compositing and ours as its mode or shape changes. */
+static void
+update_redirect(Display *dpy, win_it w) {
+    if (!hybridRedirect || w->a.c_class == InputOnly)
+        return;
+    Bool manual = w->mode != WINDOW_SOLID || win_shaped(dpy, w);
+    if (manual == w->redirected)
+        return;
 
-    if (result == Success && data != (unsigned char *) None) {
-        Atom a;
-//        memcpy(&a, data, sizeof(Atom));
-        a = *data;
-        XFree(data);
-        return a;
+    set_ignore(dpy, NextRequest (dpy));
+    if (manual)
+        XCompositeRedirectWindow(dpy, w->id, CompositeRedirectManual);
+    else
+        XCompositeUnredirectWindow(dpy, w->id, CompositeRedirectManual);
+    /* the shadow comes or goes with it */
+    if (w->extents) {
+        add_damage(w->extentsRect);
+        XFixesDestroyRegion(dpy, w->extents);
+        w->extents = None;
     }
-    return winNormalAtom;
+    w->redirected = manual;
+    if (!manual)
+        w->damageWaiting = False;
+    add_damage(win_extents(dpy, w));
 }
 
 static void
@@ -656,6 +3196,10 @@ determine_mode(Display *dpy, win_it w) {
         XRenderFreePicture(dpy, w->alphaPict);
         w->alphaPict = None;
     }
+    if (w->shadowPict) {
+        XRenderFreePicture(dpy, w->shadowPict);
+        w->shadowPict = None;
+    }
     format = w->a.c_class == InputOnly ? nullptr : XRenderFindVisualFormat(dpy, w->a.visual);
 
     if (format && format->type == PictTypeDirect && format->direct.alphaMask) {
@@ -665,56 +3209,126 @@ determine_mode(Display *dpy, win_it w) {
     } else {
         mode = WINDOW_SOLID;
     }
-    w->mode = mode;
-    if (w->extents) {
-        XserverRegion damage;
-        damage = XFixesCreateRegion(dpy, nullptr, 0);
-        XFixesCopyRegion(dpy, damage, w->extents);
-        add_damage(dpy, damage);
+    /* the mode decides whether there is a shadow to cover */
+    if (w->mode != mode && w->extents) {
+        add_damage(w->extentsRect);
+        XFixesDestroyRegion(dpy, w->extents);
+        w->extents = None;
     }
+    w->mode = mode;
+    if (w->extents)
+        add_damage(w->extentsRect);
+    update_redirect(dpy, w);
 }
 
+/* The type usually sits on the client window inside the frame, so walk
+   the tree a level at a time: one round trip for all the trees of a level
+   and one for all the type properties of their children.
+ */
 static Atom
-determine_wintype(Display *dpy, Window w) {
-    Window root_return, parent_return;
-    Window *children = nullptr;
-    unsigned int nchildren, i;
+determine_wintype(Display *dpy, Window w, xcb_get_property_cookie_t typeCookie) {
+    std::vector<Window> level;
+    std::vector<Window> children;
+    std::vector<xcb_query_tree_cookie_t> trees;
+    std::vector<xcb_get_property_cookie_t> types;
     Atom type;
 
-    type = get_wintype_prop(dpy, w);
+    type = wintype_from_reply(xcb_get_property_reply(xconn, typeCookie, nullptr));
     if (type != winNormalAtom)
         return type;
 
-    if (!XQueryTree(dpy, w, &root_return, &parent_return, &children,
-                    &nchildren)) {
-        /* XQueryTree failed. */
-        if (children)
-            XFree(children);
-        return winNormalAtom;
-    }
+    level.push_back(w);
+    while (!level.empty()) {
+        trees.clear();
+        for (Window parent : level)
+            trees.push_back(xcb_query_tree(xconn, parent));
+
+        children.clear();
+        for (auto cookie : trees) {
+            xcb_query_tree_reply_t *reply = xcb_query_tree_reply(xconn, cookie, nullptr);
+
+            /* XQueryTree failed. */
+            if (!reply)
+                continue;
+            xcb_window_t *kids = xcb_query_tree_children(reply);
+            children.insert(children.end(), kids, kids + xcb_query_tree_children_length(reply));
+            free(reply);
+        }
 
-    for (i = 0; i < nchildren; i++) {
-        type = determine_wintype(dpy, children[i]);
+        types.clear();
+        for (Window child : children)
+            types.push_back(get_wintype_prop(child));
+        for (auto cookie : types) {
+            if (type != winNormalAtom) {
+                xcb_discard_reply(xconn, cookie.sequence);
+                continue;
+            }
+            type = wintype_from_reply(xcb_get_property_reply(xconn, cookie, nullptr));
+        }
         if (type != winNormalAtom)
             return type;
-    }
 
-    if (children)
-        XFree(children);
+        level.swap(children);
+    }
 
     return winNormalAtom;
 }
 
-static void
-add_win(Display *dpy, Window id, Window prev) {
+/* every query add_win needs, sent before any reply is waited for */
+struct win_query {
+    Window id;
+    xcb_get_window_attributes_cookie_t attr;
+    xcb_get_geometry_cookie_t geom;
+    xcb_get_property_cookie_t type;
+};
 
-    win placeholder = {.id = id};
-    set_ignore(dpy, NextRequest (dpy));
-    if (!XGetWindowAttributes(dpy, id, &placeholder.a)) {
+static win_query
+add_win_request(Window id) {
+    win_query q;
+
+    q.id = id;
+    q.attr = xcb_get_window_attributes(xconn, id);
+    q.geom = xcb_get_geometry(xconn, id);
+    q.type = get_wintype_prop(id);
+    return q;
+}
+
+static void
+add_win_reply(Display *dpy, const win_query &q, Window prev) {
+    Window id = q.id;
+    xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(xconn, q.attr, nullptr);
+    xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(xconn, q.geom, nullptr);
+
+    /* the window is already gone */
+    if (!attr || !geom) {
+        free(attr);
+        free(geom);
+        xcb_discard_reply(xconn, q.type.sequence);
         return;
     }
 
+    win placeholder = {.id = id};
+    placeholder.a.x = geom->x;
+    placeholder.a.y = geom->y;
+    placeholder.a.width = geom->width;
+    placeholder.a.height = geom->height;
+    placeholder.a.border_width = geom->border_width;
+    placeholder.a.depth = geom->depth;
+    placeholder.a.root = geom->root;
+    placeholder.a.visual = find_visual(dpy, attr->visual);
+    placeholder.a.c_class = attr->_class;
+    placeholder.a.map_state = attr->map_state;
+    placeholder.a.override_redirect = attr->override_redirect;
+    placeholder.a.colormap = attr->colormap;
+    placeholder.a.all_event_masks = attr->all_event_masks;
+    placeholder.a.your_event_mask = attr->your_event_mask;
+    placeholder.a.do_not_propagate_mask = attr->do_not_propagate_mask;
+    placeholder.a.screen = ScreenOfDisplay (dpy, scr);
+    free(attr);
+    free(geom);
+
     placeholder.shaped = False;
+    placeholder.shapeKnown = False;
     placeholder.shape_bounds.x = placeholder.a.x;
     placeholder.shape_bounds.y = placeholder.a.y;
     placeholder.shape_bounds.width = placeholder.a.width;
@@ -725,24 +3339,53 @@ add_win(Display *dpy, Window id, Window prev) {
 #endif
 #if HAS_NAME_WINDOW_PIXMAP
     placeholder.pixmap = None;
+    placeholder.pixmapBytes = 0;
+    placeholder.stale = False;
 #endif
+    placeholder.lastUsed = 0;
     placeholder.picture = None;
     if (placeholder.a.c_class == InputOnly) {
         placeholder.damage_sequence = 0;
         placeholder.damage = None;
     } else {
         placeholder.damage_sequence = NextRequest (dpy);
-        placeholder.damage = XDamageCreate(dpy, id, XDamageReportNonEmpty);
+        placeholder.damage = XDamageCreate(dpy, id, XDamageReportDeltaRectangles);
         XShapeSelectInput(dpy, id, ShapeNotifyMask);
     }
     placeholder.alphaPict = None;
+    placeholder.shadowPict = None;
+    placeholder.shadow = None;
+    placeholder.shadow_dx = 0;
+    placeholder.shadow_dy = 0;
+    placeholder.shadow_width = 0;
+    placeholder.shadow_height = 0;
+    placeholder.shadow_level = 0;
+    placeholder.fadeIn = False;
+    placeholder.damageWaiting = False;
+    placeholder.repaints = 0;
+    placeholder.repaintRate = 0;
+    placeholder.redirected = False;
+    placeholder.paintMode = WINDOW_SOLID;
+    placeholder.movedAt = {0, 0};
+    placeholder.blendSkipped = False;
+    placeholder.background = False;
+    placeholder.deferred = {0, 0, 0, 0};
+    placeholder.damageFrame = 0;
+    placeholder.damageStreak = 0;
+    placeholder.aboveLayer = False;
+    placeholder.thumbPixmap = None;
+    placeholder.thumbPicture = None;
+    placeholder.thumbSource = None;
+    placeholder.thumbWidth = 0;
+    placeholder.thumbHeight = 0;
+    placeholder.thumbDirty = {0, 0, 0, 0};
     placeholder.borderSize = None;
     placeholder.extents = None;
     placeholder.opacity = OPAQUE;
 
     placeholder.borderClip = None;
 
-    placeholder.windowType = determine_wintype(dpy, placeholder.id);
+    placeholder.windowType = determine_wintype(dpy, placeholder.id, q.type);
 
     if (prev) {
         for (auto it = win_list.begin(); it != win_list.end(); ++it) {
@@ -755,7 +3398,12 @@ add_win(Display *dpy, Window id, Window prev) {
         win_list.push_front(placeholder);
 
     if (placeholder.a.map_state == IsViewable)
-        map_win(dpy, id);
+        map_win(dpy, id, False);
+}
+
+static void
+add_win(Display *dpy, Window id, Window prev) {
+    add_win_reply(dpy, add_win_request(id), prev);
 }
 
 static void
@@ -765,25 +3413,39 @@ restack_win(Display *dpy, win_it w, win_it new_above) {
     if (next_w != win_list.end())
         old_above = next_w;
 
+    /* relink the node, iterators held by callers and fades stay valid */
     if (old_above != new_above) {
-        win_list.insert(new_above, *w);
-        win_list.erase(w);
+        win_list.splice(new_above, win_list, w);
+        /* the window may have moved across the layer */
+        if (backdrop && w->extents)
+            mark_tiles(backdropTiles, w->extentsRect.x, w->extentsRect.y,
+                       w->extentsRect.width, w->extentsRect.height);
     }
 }
 
 static void
 configure_win(Display *dpy, XConfigureEvent *ce) {
     win_it w = find_win(ce->window);
-    XserverRegion damage = None;
+    Bool damage = False;
 
     if (w == win_list.end()) {
         if (ce->window == root) {
             if (rootBuffer) {
+                forget_clip_picture(rootBuffer);
                 XRenderFreePicture(dpy, rootBuffer);
                 rootBuffer = None;
             }
             root_width = ce->width;
             root_height = ce->height;
+            free_root_tile(dpy);
+            free_backdrop(dpy);
+            if (captureDir) {
+                forget_clip_picture(rootPicture);
+                XRenderFreePicture(dpy, rootPicture);
+                rootPicture = root_picture(dpy);
+            }
+            resize_damage_tiles();
+            add_damage(0, 0, root_width, root_height);
         }
         return;
     }
@@ -791,45 +3453,54 @@ configure_win(Display *dpy, XConfigureEvent *ce) {
     if (w->usable)
 #endif
     {
-        damage = XFixesCreateRegion(dpy, nullptr, 0);
+        damage = True;
         if (w->extents != None)
-            XFixesCopyRegion(dpy, damage, w->extents);
+            add_damage(w->extentsRect);
     }
     w->shape_bounds.x -= w->a.x;
     w->shape_bounds.y -= w->a.y;
+    int dx = ce->x - w->a.x, dy = ce->y - w->a.y;
     w->a.x = ce->x;
     w->a.y = ce->y;
     if (w->a.width != ce->width || w->a.height != ce->height) {
 #if HAS_NAME_WINDOW_PIXMAP
-        if (w->pixmap) {
-            XFreePixmap(dpy, w->pixmap);
-            w->pixmap = None;
-            if (w->picture) {
-                XRenderFreePicture(dpy, w->picture);
-                w->picture = None;
-            }
-        }
+        if (w->pixmap)
+            release_pixmap(dpy, w);
 #endif
+        free_shadow(dpy, w);
+        /* rebuilt at the new size once the window is drawn again */
+        free_thumbnail(dpy, w);
+    }
+    /* Only this window's regions depend on its geometry; the others'
+       stay valid and the clips between windows are rebuilt every frame
+       anyway.  A plain move shifts them on the server. */
+    if (w->a.width != ce->width || w->a.height != ce->height
+        || w->a.border_width != ce->border_width) {
+        free_regions(dpy, w);
+    } else if (dx || dy) {
+        if (frameBudget)
+            clock_gettime(CLOCK_MONOTONIC, &w->movedAt);
+        if (w->borderSize)
+            XFixesTranslateRegion(dpy, w->borderSize, dx, dy);
+        if (w->extents) {
+            XFixesTranslateRegion(dpy, w->extents, dx, dy);
+            w->extentsRect.x += dx;
+            w->extentsRect.y += dy;
+        }
     }
     w->a.width = ce->width;
     w->a.height = ce->height;
     w->a.border_width = ce->border_width;
     w->a.override_redirect = ce->override_redirect;
     restack_win(dpy, w, find_win(ce->above));
-    if (damage) {
-        XserverRegion extents = win_extents(dpy, w);
-        XFixesUnionRegion(dpy, damage, damage, extents);
-        XFixesDestroyRegion(dpy, extents);
-        add_damage(dpy, damage);
-    }
+    if (damage)
+        add_damage(win_extents(dpy, w));
     w->shape_bounds.x += w->a.x;
     w->shape_bounds.y += w->a.y;
     if (!w->shaped) {
         w->shape_bounds.width = w->a.width;
         w->shape_bounds.height = w->a.height;
     }
-
-    clipChanged = True;
 }
 
 static void
@@ -845,23 +3516,25 @@ circulate_win(Display *dpy, XCirculateEvent *ce) {
     else
         new_above = win_list.end();
     restack_win(dpy, w, new_above);
-    clipChanged = True;
 }
 
 static void
 finish_destroy_win(Display *dpy, win_it w, Bool gone) {
 
+    cleanup_fade(dpy, w);
     if (gone)
         finish_unmap_win(dpy, w);
-    if (w->picture) {
-        set_ignore(dpy, NextRequest (dpy));
-        XRenderFreePicture(dpy, w->picture);
-        w->picture = None;
-    }
+    release_pixmap(dpy, w);
+    free_thumbnail(dpy, w);
     if (w->alphaPict) {
         XRenderFreePicture(dpy, w->alphaPict);
         w->alphaPict = None;
     }
+    if (w->shadowPict) {
+        XRenderFreePicture(dpy, w->shadowPict);
+        w->shadowPict = None;
+    }
+    free_shadow(dpy, w);
     if (w->damage != None) {
         set_ignore(dpy, NextRequest (dpy));
         XDamageDestroy(dpy, w->damage);
@@ -880,8 +3553,18 @@ destroy_callback(Display *dpy, win_it w, Bool gone) {
 #endif
 
 static void
-destroy_win(Display *dpy, Window id, Bool gone) {
+destroy_win(Display *dpy, Window id, Bool gone, Bool fade) {
     win_it w = find_win(id);
+
+    if (w == win_list.end())
+        return;
+#if HAS_NAME_WINDOW_PIXMAP
+    /* an unmapped window may still hold its pixmap, but is not shown */
+    if (w->pixmap && w->damaged && fade && fadeWindows)
+        set_fade(dpy, w, w->opacity * 1.0 / OPAQUE, 0.0, fade_out_step,
+                 destroy_callback, gone, False, True);
+    else
+#endif
     {
         finish_destroy_win(dpy, w, gone);
     }
@@ -913,6 +3596,11 @@ damage_win(Display *dpy, XDamageNotifyEvent *de) {
 
     if (w == win_list.end())
         return;
+    /* in hybrid mode the server presents plain windows, not our frames */
+    if (!w->damageWaiting && (!hybridRedirect || w->redirected)) {
+        w->damageWaiting = True;
+        clock_gettime(CLOCK_MONOTONIC, &w->damagedAt);
+    }
 #if CAN_DO_USABLE
     if (!w->usable)
     {
@@ -953,13 +3641,37 @@ damage_win(Display *dpy, XDamageNotifyEvent *de) {
         w->a.width <= w->damage_bounds.x + w->damage_bounds.width &&
         w->a.height <= w->damage_bounds.y + w->damage_bounds.height)
     {
-        clipChanged = True;
         w->usable = True;
     }
     }
     if (w->usable)
 #endif
-    repair_win(dpy, w);
+    repair_win(dpy, w, de->area);
+}
+
+static int
+latency_class(const win &w) {
+    if (w.windowType == winNormalAtom)
+        return LATENCY_NORMAL;
+    if (w.windowType == winDialogAtom)
+        return LATENCY_DIALOG;
+    if (w.windowType == winMenuAtom)
+        return LATENCY_MENU;
+    if (w.windowType == winDockAtom)
+        return LATENCY_DOCK;
+    return LATENCY_OTHER;
+}
+
+/* the frame that just completed presents all damage received so far */
+static void
+record_latency() {
+    for (auto &w : win_list) {
+        /* held back under overload, timed once it is flushed and painted */
+        if (!w.damageWaiting || (w.deferred.width && w.deferred.height))
+            continue;
+        w.damageWaiting = False;
+        hist_add(&latencyHist[latency_class(w)], elapsed(w.damagedAt));
+    }
 }
 
 #if DEBUG_SHAPE
@@ -989,10 +3701,9 @@ shape_win(Display *dpy, XShapeEvent *se) {
     if (w == win_list.end())
         return;
 
-    if (se->kind == ShapeClip || se->kind == ShapeBounding) {
-        XserverRegion region0;
-        XserverRegion region1;
-
+    /* the cached shape is the bounding one, clip and input shapes do
+       not change what is painted */
+    if (se->kind == ShapeBounding) {
 #if DEBUG_SHAPE
         printf("win 0x%lx %s:%s %ux%u+%d+%d\n",
          (unsigned long) se->window,
@@ -1002,9 +3713,8 @@ shape_win(Display *dpy, XShapeEvent *se) {
          se->x, se->y);
 #endif
 
-        clipChanged = True;
-
-        region0 = XFixesCreateRegion(dpy, &w->shape_bounds, 1);
+        /* repaint the old and new region with the rest of the frame */
+        add_damage(w->shape_bounds);
 
         if (se->shaped == True) {
             w->shaped = True;
@@ -1019,21 +3729,110 @@ shape_win(Display *dpy, XShapeEvent *se) {
                                static_cast<unsigned short>(w->a.width),
                                static_cast<unsigned short>(w->a.height)};
         }
+        add_damage(w->shape_bounds);
+
+        /* only this window's border changes, the clips of the others
+           are recomputed every frame anyway */
+        if (se->shaped == True)
+            fetch_shape(dpy, w);
+        else {
+            w->shapeKnown = True;
+            w->shapeRects.clear();
+        }
+        if (w->borderSize) {
+            destroy_region(dpy, w->borderSize);
+            w->borderSize = None;
+        }
+        update_redirect(dpy, w);
+    }
+}
+
+/* Nobody sees frames while DPMS has the monitor off or the screensaver
+   blanked it, nor under a screensaver window that covers every pixel.
+   Damage piles up in the tiles meanwhile, and on wake the whole screen
+   is painted once.  DPMS sends no events, so its state is asked for at
+   most every DPMS_INTERVAL when a frame is due, and that often while
+   the monitor is off to notice it coming back.
+ */
+#define DPMS_INTERVAL    1.0
+
+static void
+wake_output() {
+    add_damage(0, 0, root_width, root_height);
+    /* nothing was late, it was not shown */
+    for (auto &w: win_list)
+        w.damageWaiting = False;
+}
+
+static void
+saver_notify(XScreenSaverNotifyEvent *se) {
+    if (se->state == ScreenSaverCycle)
+        return;
+    Bool on = se->state == ScreenSaverOn;
+
+    if (saverOn && !on)
+        wake_output();
+    saverOn = on;
+    saverBlanked = se->kind == ScreenSaverBlanked;
+    saverWindow = se->window;
+    saverDamaged = False;
+}
 
-        region1 = XFixesCreateRegion(dpy, &w->shape_bounds, 1);
-        XFixesUnionRegion(dpy, region0, region0, region1);
-        XFixesDestroyRegion(dpy, region1);
+static Bool
+saver_covers(Display *dpy) {
+    for (auto w = win_list.begin(); w != win_list.end(); w++) {
+        if (w->a.map_state != IsViewable)
+            continue;
+        return w->id == saverWindow && w->mode == WINDOW_SOLID
+               && w->a.x <= 0 && w->a.y <= 0
+               && w->a.x + w->a.width + w->a.border_width * 2 >= root_width
+               && w->a.y + w->a.height + w->a.border_width * 2 >= root_height
+               && !win_shaped(dpy, w);
+    }
+    return False;
+}
 
-        /* ask for repaint of the old and new region */
-        paint_all(dpy, region0);
+/* Called when a frame is due; True holds it back.  Under a covering
+   screensaver window only damage to that window gets painted.  fresh
+   says events came in, the wakeups that only look at DPMS do not make
+   a frame of their own and are not counted as withheld. */
+static Bool
+output_hidden(Display *dpy, Bool fresh) {
+    if (hasDpms && elapsed(dpmsChecked) >= DPMS_INTERVAL) {
+        CARD16 level;
+        BOOL enabled;
+
+        clock_gettime(CLOCK_MONOTONIC, &dpmsChecked);
+        Bool off = DPMSInfo(dpy, &level, &enabled) && enabled && level != DPMSModeOn;
+        if (dpmsOff && !off)
+            wake_output();
+        dpmsOff = off;
+    }
+    if (dpmsOff || (saverOn && saverBlanked)
+        || (saverOn && !saverDamaged && saver_covers(dpy))) {
+        if (fresh)
+            stats.framesWithheld++;
+        return True;
     }
+    saverDamaged = False;
+    return False;
+}
+
+/* milliseconds until output_hidden should look at DPMS again, or -1;
+   with nothing to paint there is no need to */
+static int
+output_timeout() {
+    if (!dpmsOff || !damagePending)
+        return -1;
+    double since = elapsed(dpmsChecked);
+    return since < DPMS_INTERVAL ? (int) ((DPMS_INTERVAL - since) * 1000) + 1 : 0;
 }
 
 static int
 error(Display *dpy, XErrorEvent *ev) {
     int o;
     const char *name = nullptr;
-    static char buffer[256];
+    static thread_local char buffer[256];
 
     if (should_ignore(dpy, ev->serial))
         return 0;
@@ -1097,9 +3896,8 @@ error(Display *dpy, XErrorEvent *ev) {
 
 static void
 expose_root(Display *dpy, Window rootWin, XRectangle *rects, int nrects) {
-    XserverRegion region = XFixesCreateRegion(dpy, rects, nrects);
-
-    add_damage(dpy, region);
+    for (int i = 0; i < nrects; i++)
+        add_damage(rects[i]);
 }
 
 #if DEBUG_EVENTS
@@ -1175,8 +3973,25 @@ usage(const char *program) {
             "Options:\n"
             "   -d display\n"
             "      Specifies which display should be managed.\n"
+            "   -r radius\n"
+            "      Specifies the blur radius for client-side shadows. (default 12)\n"
+            "   -o opacity\n"
+            "      Specifies the translucency for client-side shadows. (default .75)\n"
+            "   -l left-offset\n"
+            "      Specifies the left offset for client-side shadows. (default -15)\n"
+            "   -t top-offset\n"
+            "      Specifies the top offset for client-side shadows. (default -15)\n"
+            "   -D milliseconds\n"
+            "      Specifies the length of time between fade steps. (default 10)\n"
+            "   -I fade-in-step\n"
+            "      Specifies the opacity change between steps while fading in. (default 0.028)\n"
+            "   -O fade-out-step\n"
+            "      Specifies the opacity change between steps while fading out. (default 0.03)\n"
             "   -a\n"
             "      Use automatic server-side compositing. Faster, but no special effects.\n"
+            "   -H\n"
+            "      Let the server composite opaque, unshaped windows and composite only\n"
+            "      translucent and shaped ones here. Only those get shadows.\n"
             "   -c\n"
             "      Draw client-side shadows with fuzzy edges.\n"
             "   -C\n"
@@ -1191,6 +4006,39 @@ usage(const char *program) {
             "      Draw server-side shadows with sharp edges.\n"
             "   -S\n"
             "      Enable synchronous operation (for debugging).\n"
+            "   -U fraction\n"
+            "      Repaint without per-window clipping once damage covers this fraction\n"
+            "      of the screen; above 1 disables it. (default 0.75)\n"
+            "   -Q milliseconds\n"
+            "      Frame time budget. While frames take longer on average, paint\n"
+            "      translucent windows and dragged ARGB windows opaque and repaint\n"
+            "      windows below the top one ten times a second. (default off)\n"
+            "   -B megabytes\n"
+            "      Keep window pixmaps across unmaps up to this much memory, evicting\n"
+            "      unmapped and off-screen ones first; 0 disables it. (default 128)\n"
+            "   -T size\n"
+            "      Keep thumbnails scaled to fit size x size for every top-level window\n"
+            "      and publish them as pixmap, width, height in its _COMPANDER_THUMBNAIL.\n"
+            "      Under a reparenting window manager that is the frame, not the client.\n"
+            "   -E\n"
+            "      Render frames into shared memory and publish its id in the root\n"
+            "      window's _COMPANDER_FRAME_SHM, with each frame's damage, for\n"
+            "      recorders to read without asking the X server.\n"
+            "   -W directory\n"
+            "      Composite offscreen instead of to the root window and write the damaged\n"
+            "      part of frames to directory as PPM, with a log of per-frame timing\n"
+            "      and damage in frames.log.\n"
+            "   -K n\n"
+            "      With -W, write out only every n-th frame; all are logged. (default 1)\n"
+            "   -M path\n"
+            "      Serve metrics in the Prometheus text format on a Unix socket at path;\n"
+            "      with several screens, screen N serves on path.N.\n"
+            "\n"
+            "   Every screen of the display is composited, each on a thread of its own.\n"
+            "   Painting pauses while DPMS has the monitor off or a screensaver hides it.\n"
+            "   SIGUSR1 prints painting statistics to stderr, SIGUSR2 toggles an overlay\n"
+            "   of recently repainted areas and per-window repaint rates, SIGTERM and\n"
+            "   SIGINT print the statistics once more and exit.\n"
     );
     exit(1);
 }
@@ -1199,17 +4047,33 @@ static Bool
 register_cm(Display *dpy) {
     Window w;
     Atom a;
-    static char net_wm_cm[] = "_NET_WM_CM_Sxx";
+    static thread_local char net_wm_cm[] = "_NET_WM_CM_Sxx";
+    static const char net_wm_name[] = "_NET_WM_NAME";
 
     snprintf(net_wm_cm, sizeof(net_wm_cm), "_NET_WM_CM_S%d", scr);
-    a = XInternAtom(dpy, net_wm_cm, False);
-
-    w = XGetSelectionOwner(dpy, a);
+    xcb_intern_atom_cookie_t cmCookie = xcb_intern_atom(xconn, 0, strlen(net_wm_cm), net_wm_cm);
+    xcb_intern_atom_cookie_t nameCookie = xcb_intern_atom(xconn, 0, strlen(net_wm_name), net_wm_name);
+    xcb_intern_atom_reply_t *cmReply = xcb_intern_atom_reply(xconn, cmCookie, nullptr);
+    xcb_intern_atom_reply_t *nameReply = xcb_intern_atom_reply(xconn, nameCookie, nullptr);
+    if (!cmReply || !nameReply) {
+        free(cmReply);
+        free(nameReply);
+        fprintf(stderr, "Can't intern %s\n", net_wm_cm);
+        return False;
+    }
+    a = cmReply->atom;
+    Atom winNameAtom = nameReply->atom;
+    free(cmReply);
+    free(nameReply);
+
+    xcb_get_selection_owner_reply_t *owner =
+            xcb_get_selection_owner_reply(xconn, xcb_get_selection_owner(xconn, a), nullptr);
+    w = owner ? owner->owner : None;
+    free(owner);
     if (w != None) {
         XTextProperty tp;
         char **strs;
         int count;
-        Atom winNameAtom = XInternAtom(dpy, "_NET_WM_NAME", False);
 
         if (!XGetTextProperty(dpy, w, &tp, winNameAtom) &&
             !XGetTextProperty(dpy, w, &tp, XA_WM_NAME)) {
@@ -1242,53 +4106,92 @@ register_cm(Display *dpy) {
     return True;
 }
 
-int
-main(int argc, char **argv) {
+static const struct {
+    const char *name;
+    Atom *atom;
+} atomTable[] = {
+        {OPACITY_PROP,                  &opacityAtom},
+        {"_NET_WM_WINDOW_TYPE",         &winTypeAtom},
+        {"_NET_WM_WINDOW_TYPE_DESKTOP", &winDesktopAtom},
+        {"_NET_WM_WINDOW_TYPE_DOCK",    &winDockAtom},
+        {"_NET_WM_WINDOW_TYPE_TOOLBAR", &winToolbarAtom},
+        {"_NET_WM_WINDOW_TYPE_MENU",    &winMenuAtom},
+        {"_NET_WM_WINDOW_TYPE_UTILITY", &winUtilAtom},
+        {"_NET_WM_WINDOW_TYPE_SPLASH",  &winSplashAtom},
+        {"_NET_WM_WINDOW_TYPE_DIALOG",  &winDialogAtom},
+        {"_NET_WM_WINDOW_TYPE_NORMAL",  &winNormalAtom},
+        {"_COMPANDER_THUMBNAIL",        &thumbnailAtom},
+        {"_XROOTPMAP_ID",               &backgroundAtoms[0]},
+        {"_XSETROOT_ID",                &backgroundAtoms[1]},
+};
+
+/* intern every atom we use with a single round trip */
+static Bool
+get_atoms() {
+    const size_t count = sizeof(atomTable) / sizeof(atomTable[0]);
+    xcb_intern_atom_cookie_t cookies[count];
+    Bool ok = True;
+
+    for (size_t i = 0; i < count; i++)
+        cookies[i] = xcb_intern_atom(xconn, 0, strlen(atomTable[i].name), atomTable[i].name);
+    for (size_t i = 0; i < count; i++) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(xconn, cookies[i], nullptr);
+
+        if (reply)
+            *atomTable[i].atom = reply->atom;
+        else
+            ok = False;
+        free(reply);
+    }
+    return ok;
+}
+
+/* Events read before a frame is painted; a client flooding us with
+   damage still sees frames go out. */
+#define MAX_BATCH    256
+
+/* Each X screen is composited by its own thread over its own
+   connection; everything the thread touches is thread_local.  The main
+   thread only takes the signals and passes them on through requests and
+   a wake-up eventfd.
+ */
+#define SCREEN_STATS    1
+#define SCREEN_EXIT    2
+#define SCREEN_HEATMAP    4
+
+struct screen_thread {
+    int screen;
+    const char *display;
+    std::string metricsPath;
+    int wakeFd;
+    std::atomic<unsigned> requests;
+    std::thread thread;
+};
+
+static void
+run_screen(screen_thread *st) {
     Display *dpy;
     XEvent ev;
     Window root_return, parent_return;
     Window *children;
     unsigned int nchildren;
     int i;
-    XRenderPictureAttributes pa;
     std::vector<XRectangle> expose_rects;
     int size_expose = 0;
     int n_expose = 0;
-    pollfd ufd{};
+    pollfd ufd[4]{};
     int p;
     int composite_major, composite_minor;
-    char *display = nullptr;
-    int o;
-
-    while ((o = getopt(argc, argv, "D:I:O:d:r:o:l:t:scnfFCaS")) != -1) {
-        switch (o) {
-            case 'd':
-                display = optarg;
-                break;
-            case 'n':
-                compMode = CompSimple;
-                break;
-            case 'a':
-                autoRedirect = True;
-                break;
-            case 'S':
-                synchronize = True;
-                break;
-            default:
-                usage(argv[0]);
-                break;
-        }
-    }
 
-    dpy = XOpenDisplay(display);
+    dpy = XOpenDisplay(st->display);
     if (!dpy) {
         fprintf(stderr, "Can't open display\n");
         exit(1);
     }
-    XSetErrorHandler(error);
+    xconn = XGetXCBConnection(dpy);
     if (synchronize)
         XSynchronize(dpy, 1);
-    scr = DefaultScreen (dpy);
+    scr = st->screen;
     root = RootWindow (dpy, scr);
 
     if (!XRenderQueryExtension(dpy, &render_event, &render_error)) {
@@ -1318,64 +4221,128 @@ main(int argc, char **argv) {
         fprintf(stderr, "No XShape extension\n");
         exit(1);
     }
+    int ignored;
+    XQueryExtension(dpy, RENDER_NAME, &render_opcode, &ignored, &ignored);
+    XQueryExtension(dpy, XFIXES_NAME, &xfixes_opcode, &ignored, &ignored);
+    XQueryExtension(dpy, DAMAGE_NAME, &damage_opcode, &ignored, &ignored);
+    XQueryExtension(dpy, SHAPENAME, &xshape_opcode, &ignored, &ignored);
+    hasDpms = DPMSQueryExtension(dpy, &ignored, &ignored) && DPMSCapable(dpy);
+    if (!XScreenSaverQueryExtension(dpy, &saver_event, &ignored))
+        saver_event = -1;
+    XESetBeforeFlush(dpy, XAddExtension(dpy)->extension, count_requests);
 
     if (!register_cm(dpy)) {
         exit(1);
     }
 
-    /* get atoms */
-    opacityAtom = XInternAtom(dpy, OPACITY_PROP, False);
-    winTypeAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
-    winDesktopAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-    winDockAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DOCK", False);
-    winToolbarAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_TOOLBAR", False);
-    winMenuAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_MENU", False);
-    winUtilAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_UTILITY", False);
-    winSplashAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_SPLASH", False);
-    winDialogAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
-    winNormalAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_NORMAL", False);
-
-    pa.subwindow_mode = IncludeInferiors;
-
     root_width = DisplayWidth (dpy, scr);
     root_height = DisplayHeight (dpy, scr);
 
-    rootPicture = XRenderCreatePicture(dpy, root,
-                                       XRenderFindVisualFormat(dpy,
-                                                               DefaultVisual (dpy, scr)),
-                                       CPSubwindowMode,
-                                       &pa);
+    rootPicture = root_picture(dpy);
+    if (captureDir && !open_capture())
+        exit(1);
     blackPicture = solid_picture(dpy, True, 1, 0, 0, 0);
-    allDamage = None;
-    clipChanged = True;
+    if (compMode == CompServerShadows)
+        transBlackPicture = solid_picture(dpy, True, 0.3, 0, 0, 0);
+    resize_damage_tiles();
+    /* before the scan: update_opacity may start fades for mapped windows */
+    if (fadeWindows || fadeTrans)
+        fadeTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     XGrabServer(dpy);
     if (autoRedirect)
         XCompositeRedirectSubwindows(dpy, root, CompositeRedirectAutomatic);
     else {
-        XCompositeRedirectSubwindows(dpy, root, CompositeRedirectManual);
+        XCompositeRedirectSubwindows(dpy, root, hybridRedirect ? CompositeRedirectAutomatic
+                                                               : CompositeRedirectManual);
         XSelectInput(dpy, root,
                      SubstructureNotifyMask |
                      ExposureMask |
                      StructureNotifyMask |
                      PropertyChangeMask);
         XShapeSelectInput(dpy, root, ShapeNotifyMask);
+        if (saver_event >= 0) {
+            XScreenSaverInfo *info = XScreenSaverAllocInfo();
+
+            XScreenSaverSelectInput(dpy, root, ScreenSaverNotifyMask);
+            if (info && XScreenSaverQueryInfo(dpy, root, info)) {
+                saverOn = info->state == ScreenSaverOn;
+                saverBlanked = info->kind == ScreenSaverBlanked;
+                saverWindow = info->window;
+            }
+            XFree(info);
+        }
         XQueryTree(dpy, root, &root_return, &parent_return, &children, &nchildren);
+        /* queue the queries for every window before collecting any reply */
+        std::vector<win_query> queries;
+        queries.reserve(nchildren);
         for (i = 0; i < nchildren; i++)
-            add_win(dpy, children[i], i ? children[i - 1] : None);
+            queries.push_back(add_win_request(children[i]));
+        for (i = 0; i < nchildren; i++)
+            add_win_reply(dpy, queries[i], i ? children[i - 1] : None);
         XFree(children);
+        update_opacity(dpy);
     }
     XUngrabServer(dpy);
-    ufd.fd = ConnectionNumber (dpy);
-    ufd.events = POLLIN;
-    if (!autoRedirect)
-        paint_all(dpy, None);
+
+    ufd[0].fd = ConnectionNumber (dpy);
+    ufd[0].events = POLLIN;
+    /* poll skips a negative fd, so without fades this costs nothing */
+    ufd[1].fd = fadeTimer;
+    ufd[1].events = POLLIN;
+    if (!st->metricsPath.empty())
+        metricsFd = open_metrics(st->metricsPath.c_str());
+    ufd[2].fd = metricsFd;
+    ufd[2].events = POLLIN;
+    ufd[3].fd = st->wakeFd;
+    ufd[3].events = POLLIN;
+    if (!autoRedirect) {
+        paint_all(dpy, None, 0);
+        XSync(dpy, False);
+        export_end();
+        if (captureDir)
+            capture_frame(dpy, 0, (long) root_width * root_height);
+    }
     while (true) {
+        int batch = 0;
         /*	dump_wins (); */
-        do {
-            if (autoRedirect)
-                XFlush(dpy);
-
+        /* sleep only when nothing is buffered; the fade timer, the metrics
+           socket and the main thread can also wake us.  With events
+           waiting they are still looked at, so a flood of events starves
+           neither them nor painting. */
+        int timeout = sooner(sooner(update_thumbnails(dpy), heat_timeout()),
+                             sooner(quality_timeout(), output_timeout()));
+
+        if (XEventsQueued(dpy, QueuedAfterFlush))
+            timeout = 0;
+        if (poll(ufd, 4, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (ufd[3].revents & POLLIN) {
+            uint64_t count;
+            unsigned requests = st->requests.exchange(0);
+
+            if (read(st->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                perror("eventfd");
+            if (requests & SCREEN_HEATMAP)
+                toggle_heatmap();
+            if (requests & (SCREEN_STATS | SCREEN_EXIT))
+                print_stats();
+            if (requests & SCREEN_EXIT) {
+                if (!st->metricsPath.empty())
+                    unlink(st->metricsPath.c_str());
+                XCloseDisplay(dpy);
+                return;
+            }
+        }
+        if (ufd[1].revents & POLLIN)
+            run_fades(dpy);
+        if (ufd[2].revents & POLLIN)
+            serve_metrics();
+        /* at most MAX_BATCH events go into a frame */
+        while (batch < MAX_BATCH && XEventsQueued(dpy, QueuedAfterReading)) {
             XNextEvent(dpy, &ev);
+            batch++;
             if ((ev.type & 0x7f) != KeymapNotify)
                 discard_ignore(dpy, ev.xany.serial);
 #if DEBUG_EVENTS
@@ -1391,10 +4358,10 @@ main(int argc, char **argv) {
                         configure_win(dpy, &ev.xconfigure);
                         break;
                     case DestroyNotify:
-                        destroy_win(dpy, ev.xdestroywindow.window, True);
+                        destroy_win(dpy, ev.xdestroywindow.window, True, True);
                         break;
                     case MapNotify:
-                        map_win(dpy, ev.xmap.window);
+                        map_win(dpy, ev.xmap.window, True);
                         break;
                     case UnmapNotify:
                         unmap_win(dpy, ev.xunmap.window, True);
@@ -1403,7 +4370,7 @@ main(int argc, char **argv) {
                         if (ev.xreparent.parent == root)
                             add_win(dpy, ev.xreparent.window, 0);
                         else
-                            destroy_win(dpy, ev.xreparent.window, False);
+                            destroy_win(dpy, ev.xreparent.window, False, True);
                         break;
                     case CirculateNotify:
                         circulate_win(dpy, &ev.xcirculate);
@@ -1428,23 +4395,19 @@ main(int argc, char **argv) {
                         break;
                     case PropertyNotify:
                         for (p = 0; backgroundProps[p]; p++) {
-                            if (ev.xproperty.atom == XInternAtom(dpy, backgroundProps[p], False)) {
+                            if (ev.xproperty.atom == backgroundAtoms[p]) {
                                 if (rootTile) {
                                     XClearArea(dpy, root, 0, 0, 0, 0, True);
-                                    XRenderFreePicture(dpy, rootTile);
-                                    rootTile = None;
+                                    free_root_tile(dpy);
                                     break;
                                 }
                             }
                         }
                         /* check if Trans property was changed */
                         if (ev.xproperty.atom == opacityAtom) {
-                            /* reset mode and redraw window */
-                            win_it w = find_win(ev.xproperty.window);
-                            if (w != win_list.end()) {
-                                w->opacity = get_opacity_prop(dpy, w, OPAQUE);
-                                determine_mode(dpy, w);
-                            }
+                            /* reset mode and redraw window once the batch is read */
+                            if (find_win(ev.xproperty.window) != win_list.end())
+                                queue_opacity(ev.xproperty.window);
                         }
                         break;
                     default:
@@ -1452,17 +4415,226 @@ main(int argc, char **argv) {
                             damage_win(dpy, (XDamageNotifyEvent *) &ev);
                         } else if (ev.type == xshape_event + ShapeNotify) {
                             shape_win(dpy, (XShapeEvent *) &ev);
+                        } else if (saver_event >= 0 && ev.type == saver_event + ScreenSaverNotify) {
+                            saver_notify((XScreenSaverNotifyEvent *) &ev);
                         }
                         break;
                 }
-        } while (QLength (dpy));
-        if (allDamage && !autoRedirect) {
-            static int paint;
-            paint_all(dpy, allDamage);
-            paint++;
+        }
+        if (batch)
+            hist_add(&batchHist, batch);
+        update_opacity(dpy);
+#if HAS_NAME_WINDOW_PIXMAP
+        trim_pixmaps(dpy);
+#endif
+        if (degraded)
+            update_quality(dpy);
+        if (hybridRedirect && damagePending)
+            clip_hybrid_damage(dpy);
+        if (heatmap)
+            update_heat();
+        if (damagePending && !autoRedirect && !output_hidden(dpy, batch > 0)) {
+            long area;
+            timespec start;
+#if DEBUG_ALLOC
+            static thread_local unsigned long frame;
+            unsigned long before = allocations;
+            unsigned long pictures = windowPictures;
+#endif
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            update_backdrop(dpy);
+            XserverRegion region = damage_region(dpy, &area);
+            export_begin();
+            paint_all(dpy, region, area);
             XSync(dpy, False);
-            allDamage = None;
-            clipChanged = False;
+            export_end();
+            record_latency();
+            double seconds = elapsed(start);
+            hist_add(&frameTimeHist, seconds);
+            if (frameBudget)
+                frame_quality(dpy, seconds);
+            if (captureDir)
+                capture_frame(dpy, seconds, area);
+#if DEBUG_ALLOC
+            /* the first frames size the scratch buffers */
+            if (++frame > 16 && windowPictures == pictures)
+                assert(allocations == before);
+#endif
+        }
+    }
+}
+
+int
+main(int argc, char **argv) {
+    Display *dpy;
+    char *display = nullptr;
+    const char *metricsPath = nullptr;
+    int o;
+
+    while ((o = getopt(argc, argv, "D:I:O:d:r:o:l:t:U:M:B:W:K:T:Q:EscnfFCaHS")) != -1) {
+        switch (o) {
+            case 'd':
+                display = optarg;
+                break;
+            case 'n':
+                compMode = CompSimple;
+                break;
+            case 'c':
+                compMode = CompClientShadows;
+                break;
+            case 's':
+                compMode = CompServerShadows;
+                break;
+            case 'C':
+                excludeDockShadows = True;
+                break;
+            case 'f':
+                fadeWindows = True;
+                break;
+            case 'F':
+                fadeTrans = True;
+                break;
+            case 'D':
+                fade_delta = atoi(optarg);
+                if (fade_delta < 1)
+                    fade_delta = 10;
+                break;
+            case 'I':
+                fade_in_step = atof(optarg);
+                if (fade_in_step <= 0)
+                    fade_in_step = 0.01;
+                break;
+            case 'O':
+                fade_out_step = atof(optarg);
+                if (fade_out_step <= 0)
+                    fade_out_step = 0.01;
+                break;
+            case 'r':
+                shadowRadius = atoi(optarg);
+                break;
+            case 'o':
+                shadowOpacity = atof(optarg);
+                break;
+            case 'l':
+                shadowOffsetX = atoi(optarg);
+                break;
+            case 't':
+                shadowOffsetY = atoi(optarg);
+                break;
+            case 'a':
+                autoRedirect = True;
+                break;
+            case 'H':
+                hybridRedirect = True;
+                break;
+            case 'Q':
+                frameBudget = atof(optarg) / 1000;
+                break;
+            case 'S':
+                synchronize = True;
+                break;
+            case 'U':
+                fullRepaintFraction = atof(optarg);
+                break;
+            case 'M':
+                metricsPath = optarg;
+                break;
+            case 'W':
+                captureDir = optarg;
+                break;
+            case 'E':
+                exportFrames = True;
+                break;
+            case 'T':
+                thumbnailSize = atoi(optarg);
+                if (thumbnailSize < 0)
+                    thumbnailSize = 0;
+                break;
+            case 'K':
+                captureEvery = atoi(optarg);
+                if (captureEvery < 1)
+                    captureEvery = 1;
+                break;
+#if HAS_NAME_WINDOW_PIXMAP
+            case 'B':
+                pixmapBudget = atol(optarg) << 20;
+                break;
+#endif
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    /* screens run on threads of their own */
+    XInitThreads();
+    dpy = XOpenDisplay(display);
+    if (!dpy) {
+        fprintf(stderr, "Can't open display\n");
+        exit(1);
+    }
+    XSetErrorHandler(error);
+    screenCount = ScreenCount (dpy);
+
+    /* atoms are the same on every connection, intern them once */
+    xconn = XGetXCBConnection(dpy);
+    if (!get_atoms()) {
+        fprintf(stderr, "Can't intern atoms\n");
+        exit(1);
+    }
+    XCloseDisplay(dpy);
+    xconn = nullptr;
+    if (compMode == CompClientShadows) {
+        make_gaussian_map(shadowRadius);
+        presum_gaussian(gaussianMap);
+    }
+
+    /* SIGUSR1 prints the statistics, SIGUSR2 toggles the heatmap,
+       SIGTERM and SIGINT print the statistics once more and leave; only
+       the main thread takes them */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<screen_thread> screens(screenCount);
+    for (int s = 0; s < screenCount; s++) {
+        screen_thread &st = screens[s];
+
+        st.screen = s;
+        st.display = display;
+        if (metricsPath) {
+            st.metricsPath = metricsPath;
+            if (screenCount > 1)
+                st.metricsPath += "." + std::to_string(s);
         }
+        st.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        st.requests = 0;
+        st.thread = std::thread(run_screen, &st);
     }
+
+    while (true) {
+        int sig;
+        unsigned request;
+
+        if (sigwait(&signals, &sig))
+            continue;
+        request = sig == SIGUSR1 ? SCREEN_STATS
+                : sig == SIGUSR2 ? SCREEN_HEATMAP : SCREEN_EXIT;
+        for (auto &st : screens) {
+            uint64_t one = 1;
+
+            st.requests |= request;
+            if (write(st.wakeFd, &one, sizeof(one)) < 0)
+                perror("eventfd");
+        }
+        if (request == SCREEN_EXIT)
+            break;
+    }
+    for (auto &st : screens)
+        st.thread.join();
+    return 0;
 }
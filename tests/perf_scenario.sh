@@ -0,0 +1,159 @@
+#!/usr/bin/env bash
+#
+# Runs one load scenario against the compositor on a private Xvfb and
+# compares what it measured with the stored baseline.
+#
+#   perf_scenario.sh glcomp loadgen scenario baseline
+#
+# The baseline holds one "metric value tolerance-percent" per line.
+# frames_per_second may not fall more than the tolerance below its
+# value, the others (cpu_seconds, requests_per_frame, max_rss_kb) may
+# not rise more than the tolerance above it.  With
+# COMPANDER_UPDATE_BASELINES=1 the measured values are written back to
+# the baseline, keeping the tolerances (25% for a new one), and the
+# test passes.
+#
+# Baselines are only comparable on the host that recorded them:
+#  - frames_per_second is glcomp's total frame count, the startup paint
+#    and anything painted around loadgen's run included, divided by
+#    loadgen's run time.  It is a rate for one scenario length, not a
+#    steady-state frame rate.
+#  - cpu_seconds is glcomp's absolute CPU time for the whole run, so it
+#    scales with the speed of the host.
+#
+# Exits 77, which CTest reports as skipped, when Xvfb is not installed
+# or no baseline has been recorded yet; the measurements are printed
+# either way once the scenario ran.
+
+set -u
+
+if [ $# -ne 4 ]; then
+    echo "usage: $0 glcomp loadgen scenario baseline" >&2
+    exit 2
+fi
+glcomp=$1
+loadgen=$2
+scenario=$3
+baseline=$4
+seconds=${COMPANDER_SCENARIO_SECONDS:-5}
+
+# every scenario is seeded, so each run sends the same requests
+case $scenario in
+    small-damage)
+        load="-n 40 -s 50:300 -p rects -r 2000 -c 0 -a 0 -o 0 -S 0 -P 0" ;;
+    move-storm)
+        load="-n 20 -s 100:500 -p rects -r 30 -c 200 -a 0 -o 0 -S 0 -P 5" ;;
+    opacity)
+        load="-n 20 -s 100:500 -p rects -r 30 -c 0 -a 0 -o 100 -S 0 -P 0" ;;
+    shaped)
+        load="-n 20 -s 100:500 -p rects -r 200 -c 0 -a 0 -o 0 -S 50 -P 0" ;;
+    argb)
+        load="-n 20 -s 100:500 -p video -r 500 -c 0 -a 1 -o 0 -S 0 -P 0" ;;
+    *)
+        echo "unknown scenario $scenario" >&2
+        exit 2 ;;
+esac
+
+if ! command -v Xvfb > /dev/null; then
+    echo "Xvfb not found, skipping"
+    exit 77
+fi
+tmp=$(mktemp -d)
+xvfb=
+comp=
+cleanup() {
+    [ -n "$comp" ] && kill "$comp" 2> /dev/null
+    [ -n "$xvfb" ] && kill "$xvfb" 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# Xvfb picks a free display and writes its number to fd 3
+Xvfb -displayfd 3 -screen 0 1280x1024x24 -nolisten tcp \
+     +extension Composite +extension DAMAGE +extension XFIXES \
+     +extension RENDER +extension SHAPE \
+     3> "$tmp/display" 2> "$tmp/xvfb.log" &
+xvfb=$!
+for _ in $(seq 100); do
+    [ -s "$tmp/display" ] && break
+    sleep 0.1
+done
+if [ ! -s "$tmp/display" ]; then
+    echo "Xvfb did not start:" >&2
+    cat "$tmp/xvfb.log" >&2
+    exit 1
+fi
+display=:$(head -n 1 "$tmp/display")
+
+"$glcomp" -d "$display" -M "$tmp/metrics" 2> "$tmp/stats" &
+comp=$!
+for _ in $(seq 100); do
+    [ -S "$tmp/metrics" ] && break
+    sleep 0.1
+done
+if [ ! -S "$tmp/metrics" ]; then
+    echo "glcomp did not start:" >&2
+    cat "$tmp/stats" >&2
+    exit 1
+fi
+
+# shellcheck disable=SC2086
+if ! "$loadgen" -d "$display" -t "$seconds" -z 1 $load > "$tmp/load"; then
+    echo "loadgen failed" >&2
+    exit 1
+fi
+
+# SIGTERM makes glcomp print its statistics once more and leave
+kill -TERM "$comp"
+wait "$comp"
+comp=
+
+stat() {
+    awk -v name="$1" '$1 == name { print $2; exit }' "$tmp/stats"
+}
+frames=$(stat frames)
+loadSeconds=$(awk '$1 == "seconds" { print $2 }' "$tmp/load")
+measured="$tmp/measured"
+{
+    echo "frames_per_second $(awk -v f="${frames:-0}" -v s="$loadSeconds" 'BEGIN { printf "%.1f", f / s }')"
+    echo "cpu_seconds $(stat cpu_seconds)"
+    echo "requests_per_frame $(stat requests_per_frame)"
+    echo "max_rss_kb $(stat max_rss_kb)"
+} > "$measured"
+
+echo "scenario $scenario on $display for $seconds s:"
+cat "$tmp/load" "$measured"
+
+if [ "${COMPANDER_UPDATE_BASELINES:-0}" = 1 ]; then
+    old=$baseline
+    [ -f "$old" ] || old=/dev/null
+    awk 'FILENAME == ARGV[1] { tolerance[$1] = $3; next }
+         { printf "%s %s %s\n", $1, $2, ($1 in tolerance) ? tolerance[$1] : 25 }' \
+        "$old" "$measured" > "$tmp/baseline"
+    mkdir -p "$(dirname "$baseline")"
+    cp "$tmp/baseline" "$baseline"
+    echo "updated $baseline"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "no baseline $baseline, record one with COMPANDER_UPDATE_BASELINES=1"
+    exit 77
+fi
+
+awk 'NR == FNR { value[$1] = $2; next }
+     $1 in value {
+         if (value[$1] == "") {
+             printf "%s: not reported\n", $1
+             failed = 1
+             next
+         }
+         limit = $1 == "frames_per_second" ? $2 * (1 - $3 / 100) : $2 * (1 + $3 / 100)
+         worse = $1 == "frames_per_second" ? value[$1] < limit : value[$1] > limit
+         printf "%s: %s, baseline %s, limit %.6g%s\n", $1, value[$1], $2, limit,
+                worse ? " REGRESSED" : ""
+         if (worse)
+             failed = 1
+     }
+     END { exit failed }' "$measured" "$baseline"